@@ -139,7 +139,8 @@ static void
 update_online(struct ctx *ctx, bool show_if)
 {
 	bool online, carrier;
-	char *msg, *msgs, *nmsg;
+	const char *msg;
+	char *msgs, *nmsg;
 	size_t msgs_len, mlen;
 	DHCPCD_IF *ifs, *i;
 
@@ -155,7 +156,7 @@ update_online(struct ctx *ctx, bool show_if)
 			if (i->up)
 				online = true;
 		}
-		msg = dhcpcd_if_message(i, NULL);
+		msg = dhcpcd_if_get_message(i, NULL);
 		if (msg) {
 			if (show_if) {
 				if (i->up)
@@ -163,21 +164,16 @@ update_online(struct ctx *ctx, bool show_if)
 				else
 					warning(ctx, "%s", msg);
 			}
-			if (msgs == NULL) {
-				msgs = msg;
-				msgs_len = strlen(msgs) + 1;
-			} else {
-				mlen = strlen(msg) + 1;
-				nmsg = realloc(msgs, msgs_len + mlen);
-				if (nmsg) {
-					msgs = nmsg;
+			mlen = strlen(msg) + 1;
+			nmsg = realloc(msgs, msgs_len + mlen);
+			if (nmsg) {
+				msgs = nmsg;
+				if (msgs_len != 0)
 					msgs[msgs_len - 1] = '\n';
-					memcpy(msgs + msgs_len, msg, mlen);
-					msgs_len += mlen;
-				} else
-					warn("realloc");
-				free(msg);
-			}
+				memcpy(msgs + msgs_len, msg, mlen);
+				msgs_len += mlen;
+			} else
+				warn("realloc");
 		} else if (show_if) {
 			if (i->up)
 				notify(ctx, "%s: %s", i->ifname, i->reason);
@@ -190,40 +186,138 @@ update_online(struct ctx *ctx, bool show_if)
 	free(msgs);
 }
 
+static void dispatch_timeout(void *);
+
+static void
+arm_timeout(struct ctx *ctx)
+{
+	int ms;
+
+	ms = dhcpcd_get_timeout(ctx->con);
+	if (ms == -1)
+		eloop_timeout_delete(ctx->eloop, dispatch_timeout, ctx);
+	else
+		eloop_timeout_add_msec(ctx->eloop, ms,
+		    dispatch_timeout, ctx);
+}
+
+static void
+dispatch_timeout(void *arg)
+{
+	struct ctx *ctx = arg;
+
+	dhcpcd_dispatch_timeout(ctx->con);
+	arm_timeout(ctx);
+}
+
 static void
 dispatch(void *arg)
 {
 	struct ctx *ctx = arg;
 
-	dhcpcd_dispatch(ctx->con);
+	dhcpcd_dispatch_all(ctx->con);
+	arm_timeout(ctx);
 }
 
 static void
-try_open(void *arg)
+wpa_dir_dispatch(void *arg)
 {
 	struct ctx *ctx = arg;
-	static int last_error;
-	int fd;
-
-	fd = dhcpcd_open(ctx->con);
-	if (fd == -1) {
-		if (errno != last_error) {
-			last_error = errno;
-			set_status(ctx, strerror(errno));
-		}
-		eloop_timeout_add_msec(ctx->eloop, DHCPCD_RETRYOPEN,
-		    try_open, ctx);
+
+	dhcpcd_wpa_dir_dispatch(ctx->con);
+	arm_timeout(ctx);
+}
+
+static int last_error;
+
+static void
+open_error(struct ctx *ctx)
+{
+
+	int ms;
+
+	if (errno != last_error) {
+		last_error = errno;
+		set_status(ctx, strerror(errno));
+	}
+	/* Otherwise we wait for the dhcpcd socket to appear */
+	ms = dhcpcd_wait_timeout(ctx->con);
+	if (ms != -1)
+		eloop_timeout_add_msec(ctx->eloop, ms, try_open, ctx);
+}
+
+static void
+wait_dispatch(void *arg)
+{
+	struct ctx *ctx = arg;
+
+	if (dhcpcd_wait_dispatch(ctx->con))
+		try_open(ctx);
+}
+
+static void
+open_dispatch(void *arg)
+{
+	struct ctx *ctx = arg;
+	int r, fd;
+
+	r = dhcpcd_open_dispatch(ctx->con);
+	if (r == 0)
+		return;
+	eloop_event_delete(ctx->eloop, ctx->open_fd);
+	ctx->open_fd = -1;
+	if (r == -1) {
+		open_error(ctx);
 		return;
 	}
 
 	last_error = 0;
+	debug(ctx, _("Opened dhcpcd in %ums"),
+	    dhcpcd_open_time(ctx->con));
+	if (ctx->wait_fd != -1) {
+		eloop_event_delete(ctx->eloop, ctx->wait_fd);
+		ctx->wait_fd = -1;
+	}
+	dhcpcd_wait_stop(ctx->con);
+	eloop_timeout_delete(ctx->eloop, try_open, ctx);
 
 	/* Start listening to WPA events */
 	dhcpcd_wpa_start(ctx->con);
+	if ((fd = dhcpcd_wpa_get_dir_fd(ctx->con)) != -1)
+		eloop_event_add(ctx->eloop, fd,
+		    wpa_dir_dispatch, ctx, NULL, NULL);
 
+	fd = dhcpcd_get_fd(ctx->con);
 	eloop_event_add(ctx->eloop, fd, dispatch, ctx, NULL, NULL);
 }
 
+static void
+try_open(void *arg)
+{
+	struct ctx *ctx = arg;
+
+	/* Already opening */
+	if (ctx->open_fd != -1)
+		return;
+
+	/* Watch for the socket before trying it so we can't miss it */
+	if (ctx->wait_fd == -1) {
+		ctx->wait_fd = dhcpcd_wait_start(ctx->con);
+		if (ctx->wait_fd != -1)
+			eloop_event_add(ctx->eloop, ctx->wait_fd,
+			    wait_dispatch, ctx, NULL, NULL);
+	}
+
+	ctx->open_fd = dhcpcd_open_start(ctx->con);
+	if (ctx->open_fd == -1) {
+		open_error(ctx);
+		return;
+	}
+
+	eloop_event_add(ctx->eloop, ctx->open_fd, open_dispatch, ctx,
+	    NULL, NULL);
+}
+
 static void
 status_cb(DHCPCD_CONNECTION *con,
     unsigned int status, const char *status_msg, void *arg)
@@ -241,8 +335,7 @@ status_cb(DHCPCD_CONNECTION *con,
 		ctx->online = ctx->carrier = false;
 		eloop_timeout_delete(ctx->eloop, NULL, ctx);
 		set_summary(ctx, NULL);
-		eloop_timeout_add_msec(ctx->eloop, DHCPCD_RETRYOPEN,
-		    try_open, ctx);
+		eloop_timeout_add_msec(ctx->eloop, 0, try_open, ctx);
 	} else {
 		bool refresh;
 
@@ -269,16 +362,15 @@ if_cb(DHCPCD_IF *i, void *arg)
 	if (i->state == DHS_RENEW ||
 	    i->state == DHS_STOP || i->state == DHS_STOPPED)
 	{
-		char *msg;
+		const char *msg;
 		bool new_msg;
 
-		msg = dhcpcd_if_message(i, &new_msg);
+		msg = dhcpcd_if_get_message(i, &new_msg);
 		if (msg) {
 			if (i->up)
 				warning(ctx, "%s", msg);
 			else
 				notify(ctx, "%s", msg);
-			free(msg);
 		}
 	}
 
@@ -291,10 +383,36 @@ if_cb(DHCPCD_IF *i, void *arg)
 
 static void
 wpa_dispatch(void *arg)
+{
+	WPA_EVENT *we = arg;
+
+	dhcpcd_wpa_dispatch(we->wpa);
+	arm_timeout(we->ctx);
+}
+
+static void
+wpa_command_dispatch(void *arg)
 {
 	DHCPCD_WPA *wpa = arg;
 
-	dhcpcd_wpa_dispatch(wpa);
+	dhcpcd_wpa_command_dispatch(wpa);
+}
+
+static WPA_EVENT *
+wpa_event_get(struct ctx *ctx, DHCPCD_WPA *wpa)
+{
+	WPA_EVENT *we;
+
+	TAILQ_FOREACH(we, &ctx->wpa_events, next) {
+		if (we->wpa == wpa)
+			return we;
+	}
+	if ((we = malloc(sizeof(*we))) == NULL)
+		return NULL;
+	we->ctx = ctx;
+	we->wpa = wpa;
+	TAILQ_INSERT_TAIL(&ctx->wpa_events, we, next);
+	return we;
 }
 
 static void
@@ -303,6 +421,7 @@ wpa_scan_cb(DHCPCD_WPA *wpa, void *arg)
 	struct ctx *ctx = arg;
 	DHCPCD_IF *i;
 	WI_SCAN *wi;
+	WPA_EVENT *we;
 	DHCPCD_WI_SCAN *scans, *s1, *s2;
 	int fd, lerrno;
 
@@ -311,7 +430,16 @@ wpa_scan_cb(DHCPCD_WPA *wpa, void *arg)
 		debug(ctx, "%s (%p)", _("no fd for WPA"), wpa);
 		return;
 	}
-	eloop_event_add(ctx->eloop, fd, wpa_dispatch, wpa, NULL, NULL);
+	if ((we = wpa_event_get(ctx, wpa)) == NULL) {
+		debug(ctx, "malloc: %s", strerror(errno));
+		return;
+	}
+	eloop_event_add(ctx->eloop, fd, wpa_dispatch, we, NULL, NULL);
+	if ((fd = dhcpcd_wpa_get_command_fd(wpa)) != -1)
+		eloop_event_add(ctx->eloop, fd,
+		    wpa_command_dispatch, wpa, NULL, NULL);
+	/* Scan and check wpa_supplicant is alive if it's quiet */
+	arm_timeout(ctx);
 
 	i = dhcpcd_wpa_if(wpa);
 	if (i == NULL) {
@@ -393,6 +521,7 @@ wpa_status_cb(DHCPCD_WPA *wpa,
 	struct ctx *ctx = arg;
 	DHCPCD_IF *i;
 	WI_SCAN *w, *wn;
+	WPA_EVENT *we;
 
 	i = dhcpcd_wpa_if(wpa);
 	debug(ctx, _("%s: WPA status %s"), i->ifname, status_msg);
@@ -401,6 +530,15 @@ wpa_status_cb(DHCPCD_WPA *wpa,
 
 		fd = dhcpcd_wpa_get_fd(wpa);
 		eloop_event_delete(ctx->eloop, fd);
+		fd = dhcpcd_wpa_get_command_fd(wpa);
+		eloop_event_delete(ctx->eloop, fd);
+		TAILQ_FOREACH(we, &ctx->wpa_events, next) {
+			if (we->wpa == wpa) {
+				TAILQ_REMOVE(&ctx->wpa_events, we, next);
+				free(we);
+				break;
+			}
+		}
 		dhcpcd_wpa_close(wpa);
 		TAILQ_FOREACH_SAFE(w, &ctx->wi_scans, next, wn) {
 			if (w->interface == i) {
@@ -412,27 +550,6 @@ wpa_status_cb(DHCPCD_WPA *wpa,
 	}
 }
 
-static void
-bg_scan(void *arg)
-{
-	struct ctx *ctx = arg;
-	WI_SCAN *w;
-	DHCPCD_WPA *wpa;
-
-	TAILQ_FOREACH(w, &ctx->wi_scans, next) {
-		if (w->interface->wireless& w->interface->up) {
-			wpa = dhcpcd_wpa_find(ctx->con, w->interface->ifname);
-			if (wpa &&
-			    (!w->interface->up ||
-			    dhcpcd_wpa_can_background_scan(wpa)))
-				dhcpcd_wpa_scan(wpa);
-		}
-	}
-
-	eloop_timeout_add_msec(ctx->eloop, DHCPCD_WPA_SCAN_SHORT,
-	    bg_scan, ctx);
-}
-
 static void
 signal_cb(int sig, void *arg)
 {
@@ -500,10 +617,13 @@ main(void)
 {
 	struct ctx ctx;
 	WI_SCAN *wi;
+	WPA_EVENT *we;
 	sigset_t sigmask;
 
 	memset(&ctx, 0, sizeof(ctx));
+	ctx.open_fd = ctx.wait_fd = -1;
 	TAILQ_INIT(&ctx.wi_scans);
+	TAILQ_INIT(&ctx.wpa_events);
 
 	if ((ctx.eloop = eloop_new()) == NULL)
 		err(EXIT_FAILURE, "eloop_new");
@@ -530,12 +650,11 @@ main(void)
 	dhcpcd_set_progname(ctx.con, "dhcpcd-curses");
 	dhcpcd_set_status_callback(ctx.con, status_cb, &ctx);
 	dhcpcd_set_if_callback(ctx.con, if_cb, &ctx);
+	dhcpcd_set_damping(ctx.con, DHCPCD_DAMPING);
 	dhcpcd_wpa_set_scan_callback(ctx.con, wpa_scan_cb, &ctx);
 	dhcpcd_wpa_set_status_callback(ctx.con, wpa_status_cb, &ctx);
 
 	eloop_timeout_add_sec(ctx.eloop, 0, try_open, &ctx);
-	eloop_timeout_add_msec(ctx.eloop, DHCPCD_WPA_SCAN_SHORT,
-	    bg_scan, &ctx);
 	eloop_start(ctx.eloop, &sigmask);
 
 	/* Un-resgister the callbacks to avoid spam on close */
@@ -552,6 +671,10 @@ main(void)
 		dhcpcd_wi_scans_free(wi->scans);
 		free(wi);
 	}
+	while ((we = TAILQ_FIRST(&ctx.wpa_events))) {
+		TAILQ_REMOVE(&ctx.wpa_events, we, next);
+		free(we);
+	}
 
 	/* Free everything else */
 	eloop_free(ctx.eloop);
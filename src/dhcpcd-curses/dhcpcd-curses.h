@@ -57,14 +57,25 @@ typedef struct wi_scan {
 } WI_SCAN;
 typedef TAILQ_HEAD(wi_scan_head, wi_scan) WI_SCANS;
 
+/* Given to eloop for a WPA so its events can reach the ctx */
+typedef struct wpa_event {
+	TAILQ_ENTRY(wpa_event) next;
+	struct ctx *ctx;
+	DHCPCD_WPA *wpa;
+} WPA_EVENT;
+typedef TAILQ_HEAD(wpa_event_head, wpa_event) WPA_EVENTS;
+
 struct ctx {
 	struct eloop *eloop;
 	DHCPCD_CONNECTION *con;
+	int open_fd;
+	int wait_fd;
 	bool online;
 	bool carrier;
 	unsigned int last_status;
 	size_t status_len;
 	WI_SCANS wi_scans;
+	WPA_EVENTS wpa_events;
 
 	WINDOW *stdscr;
 	WINDOW *win_status;
@@ -46,6 +46,12 @@ static guint ani_timer;
 static int ani_counter;
 static bool online;
 static bool carrier;
+static guint damp_timer;
+static guint open_timer;
+static guint wait_source;
+static guint wpa_dir_source;
+static guint command_source;
+static bool opening;
 
 struct watch {
 	gpointer ref;
@@ -55,10 +61,15 @@ struct watch {
 	struct watch *next;
 };
 static struct watch *watches;
+/* WPA command sockets, kept apart as the listen socket
+ * watch has the same reference */
+static struct watch *command_watches;
 
 WI_SCANS wi_scans;
 
 static gboolean dhcpcd_try_open(gpointer data);
+static void dhcpcd_retry_open(DHCPCD_CONNECTION *con, guint ms);
+static void dhcpcd_command_unwatch(void);
 static gboolean dhcpcd_wpa_try_open(gpointer data);
 
 WI_SCAN *
@@ -186,7 +197,8 @@ static void
 update_online(DHCPCD_CONNECTION *con, bool showif)
 {
 	bool ison, iscarrier;
-	char *msg, *msgs, *tmp;
+	const char *msg;
+	char *msgs, *tmp;
 	DHCPCD_IF *ifs, *i;
 
 	ison = iscarrier = false;
@@ -200,17 +212,16 @@ update_online(DHCPCD_CONNECTION *con, bool showif)
 			if (i->up)
 				ison = true;
 		}
-		msg = dhcpcd_if_message(i, NULL);
+		msg = dhcpcd_if_get_message(i, NULL);
 		if (msg) {
 			if (showif)
 				g_message("%s", msg);
 			if (msgs) {
 				tmp = g_strconcat(msgs, "\n", msg, NULL);
 				g_free(msgs);
-				g_free(msg);
 				msgs = tmp;
 			} else
-				msgs = msg;
+				msgs = g_strdup(msg);
 		} else if (showif)
 			g_message("%s: %s", i->ifname, i->reason);
 	}
@@ -418,7 +429,8 @@ dhcpcd_status_cb(DHCPCD_CONNECTION *con,
 			g_free(w);
 		}
 		dhcpcd_unwatch(-1, con);
-		g_timeout_add(DHCPCD_RETRYOPEN, dhcpcd_try_open, con);
+		dhcpcd_command_unwatch();
+		dhcpcd_retry_open(con, 0);
 	} else {
 		if (last == DHC_UNKNOWN || last == DHC_DOWN) {
 			g_message(_("Connected to %s-%s"), "dhcpcd",
@@ -432,6 +444,34 @@ dhcpcd_status_cb(DHCPCD_CONNECTION *con,
 	last = status;
 }
 
+static gboolean dhcpcd_timeout_cb(gpointer data);
+
+void
+dhcpcd_arm_timeout(DHCPCD_CONNECTION *con)
+{
+	int ms;
+
+	if (damp_timer) {
+		g_source_remove(damp_timer);
+		damp_timer = 0;
+	}
+	ms = dhcpcd_get_timeout(con);
+	if (ms != -1)
+		damp_timer = g_timeout_add((guint)ms, dhcpcd_timeout_cb, con);
+}
+
+static gboolean
+dhcpcd_timeout_cb(gpointer data)
+{
+	DHCPCD_CONNECTION *con;
+
+	con = (DHCPCD_CONNECTION *)data;
+	damp_timer = 0;
+	dhcpcd_dispatch_timeout(con);
+	dhcpcd_arm_timeout(con);
+	return FALSE;
+}
+
 static gboolean
 dhcpcd_cb(_unused GIOChannel *gio, _unused GIOCondition c, gpointer data)
 {
@@ -441,35 +481,136 @@ dhcpcd_cb(_unused GIOChannel *gio, _unused GIOCondition c, gpointer data)
 	if (dhcpcd_get_fd(con) == -1) {
 		g_warning(_("dhcpcd connection lost"));
 		dhcpcd_unwatch(-1, con);
-		g_timeout_add(DHCPCD_RETRYOPEN, dhcpcd_try_open, con);
+		dhcpcd_retry_open(con, 0);
 		return FALSE;
 	}
 
-	dhcpcd_dispatch(con);
+	dhcpcd_dispatch_all(con);
+	dhcpcd_arm_timeout(con);
 	return TRUE;
 }
 
+static void
+dhcpcd_retry_open(DHCPCD_CONNECTION *con, guint ms)
+{
+
+	if (open_timer == 0)
+		open_timer = g_timeout_add(ms, dhcpcd_try_open, con);
+}
+
+static void
+dhcpcd_open_error(DHCPCD_CONNECTION *con)
+{
+	static int last_error;
+	int ms;
+
+	if (errno != last_error) {
+		g_critical("dhcpcd_open: %s", strerror(errno));
+		last_error = errno;
+	}
+
+	/* Otherwise we wait for the dhcpcd socket to appear */
+	ms = dhcpcd_wait_timeout(con);
+	if (ms != -1)
+		dhcpcd_retry_open(con, (guint)ms);
+}
+
 static gboolean
-dhcpcd_try_open(gpointer data)
+dhcpcd_wait_cb(_unused GIOChannel *gio, _unused GIOCondition c,
+    gpointer data)
 {
 	DHCPCD_CONNECTION *con;
-	int fd, error;
-	static int last_error;
 
 	con = (DHCPCD_CONNECTION *)data;
-	fd = dhcpcd_open(con);
-	if (fd == -1) {
-		if (errno != last_error) {
-			g_critical("dhcpcd_open: %s", strerror(errno));
-			last_error = errno;
-		}
+	if (dhcpcd_wait_dispatch(con))
+		dhcpcd_try_open(con);
+	return TRUE;
+}
+
+static gboolean
+dhcpcd_wpa_dir_cb(_unused GIOChannel *gio, _unused GIOCondition c,
+    gpointer data)
+{
+	DHCPCD_CONNECTION *con;
+
+	con = (DHCPCD_CONNECTION *)data;
+	dhcpcd_wpa_dir_dispatch(con);
+	dhcpcd_arm_timeout(con);
+	return TRUE;
+}
+
+static void
+dhcpcd_wait_unwatch(DHCPCD_CONNECTION *con)
+{
+
+	if (wait_source != 0) {
+		g_source_remove(wait_source);
+		wait_source = 0;
+	}
+	dhcpcd_wait_stop(con);
+}
+
+static gboolean
+dhcpcd_command_cb(_unused GIOChannel *gio, _unused GIOCondition c,
+    gpointer data)
+{
+
+	dhcpcd_command_dispatch((DHCPCD_CONNECTION *)data);
+	return TRUE;
+}
+
+static void
+dhcpcd_command_watch(DHCPCD_CONNECTION *con)
+{
+	GIOChannel *gio;
+
+	dhcpcd_command_unwatch();
+	gio = g_io_channel_unix_new(dhcpcd_get_command_fd(con));
+	if (gio == NULL)
+		return;
+	command_source = g_io_add_watch(gio, G_IO_IN, dhcpcd_command_cb, con);
+	g_io_channel_unref(gio);
+}
+
+static void
+dhcpcd_command_unwatch(void)
+{
+
+	if (command_source != 0) {
+		g_source_remove(command_source);
+		command_source = 0;
+	}
+}
+
+static gboolean
+dhcpcd_open_cb(_unused GIOChannel *gio, _unused GIOCondition c,
+    gpointer data)
+{
+	DHCPCD_CONNECTION *con;
+	GIOChannel *wgio;
+	int r, error, fd;
+
+	con = (DHCPCD_CONNECTION *)data;
+	r = dhcpcd_open_dispatch(con);
+	if (r == 0)
 		return TRUE;
+	opening = false;
+	if (r == -1) {
+		dhcpcd_unwatch(-1, con);
+		dhcpcd_open_error(con);
+		return FALSE;
 	}
 
-	if (!dhcpcd_watch(fd, dhcpcd_cb, con)) {
+	g_message(_("Opened dhcpcd in %ums"), dhcpcd_open_time(con));
+	dhcpcd_wait_unwatch(con);
+
+	/* This replaces our watch */
+	if (!dhcpcd_watch(dhcpcd_get_fd(con), dhcpcd_cb, con)) {
 		dhcpcd_close(con);
-		return TRUE;
+		return FALSE;
 	}
+	/* Replies to commands we queue */
+	dhcpcd_command_watch(con);
 
 	error = dhcpcd_error(con);
 	if (error != 0) {
@@ -480,24 +621,71 @@ dhcpcd_try_open(gpointer data)
 
 	/* Start listening to WPA events */
 	dhcpcd_wpa_start(con);
+	if (wpa_dir_source == 0 && (fd = dhcpcd_wpa_get_dir_fd(con)) != -1) {
+		wgio = g_io_channel_unix_new(fd);
+		if (wgio != NULL) {
+			wpa_dir_source = g_io_add_watch(wgio, G_IO_IN,
+			    dhcpcd_wpa_dir_cb, con);
+			g_io_channel_unref(wgio);
+		}
+	}
 
 out:
 	return FALSE;
 }
 
+static gboolean
+dhcpcd_try_open(gpointer data)
+{
+	DHCPCD_CONNECTION *con;
+	GIOChannel *gio;
+	int fd;
+
+	con = (DHCPCD_CONNECTION *)data;
+	if (open_timer != 0) {
+		g_source_remove(open_timer);
+		open_timer = 0;
+	}
+	if (opening)
+		return FALSE;
+
+	/* Watch for the socket before trying it so we can't miss it */
+	if (wait_source == 0 && (fd = dhcpcd_wait_start(con)) != -1) {
+		gio = g_io_channel_unix_new(fd);
+		if (gio != NULL) {
+			wait_source = g_io_add_watch(gio, G_IO_IN,
+			    dhcpcd_wait_cb, con);
+			g_io_channel_unref(gio);
+		}
+	}
+
+	fd = dhcpcd_open_start(con);
+	if (fd == -1) {
+		dhcpcd_open_error(con);
+		return FALSE;
+	}
+
+	if (!dhcpcd_watch(fd, dhcpcd_open_cb, con)) {
+		dhcpcd_close(con);
+		dhcpcd_open_error(con);
+		return FALSE;
+	}
+	opening = true;
+	return FALSE;
+}
+
 static void
 dhcpcd_if_cb(DHCPCD_IF *i, _unused void *data)
 {
 	DHCPCD_CONNECTION *con;
-	char *msg;
-	const char *icon;
+	const char *msg, *icon;
 	bool new_msg;
 
 	/* We should ignore renew and stop so we don't annoy the user */
 	if (i->state != DHS_RENEW &&
 	    i->state != DHS_STOP && i->state != DHS_STOPPED)
 	{
-		msg = dhcpcd_if_message(i, &new_msg);
+		msg = dhcpcd_if_get_message(i, &new_msg);
 		if (msg) {
 			g_message("%s", msg);
 			if (new_msg) {
@@ -509,7 +697,6 @@ dhcpcd_if_cb(DHCPCD_IF *i, _unused void *data)
 					icon = "network-offline";
 				notify(_("Network event"), msg, icon);
 			}
-			g_free(msg);
 		}
 	}
 
@@ -532,6 +719,71 @@ dhcpcd_if_cb(DHCPCD_IF *i, _unused void *data)
 	}
 }
 
+static gboolean
+dhcpcd_wpa_command_cb(_unused GIOChannel *gio, _unused GIOCondition c,
+    gpointer data)
+{
+
+	dhcpcd_wpa_command_dispatch((DHCPCD_WPA *)data);
+	return TRUE;
+}
+
+static void
+dhcpcd_wpa_unwatch_command(DHCPCD_WPA *wpa)
+{
+	struct watch *w, *l;
+
+	l = NULL;
+	for (w = command_watches; w; w = w->next) {
+		if (w->ref == wpa)
+			break;
+		l = w;
+	}
+	if (w == NULL)
+		return;
+	if (l)
+		l->next = w->next;
+	else
+		command_watches = w->next;
+	g_source_remove(w->eventid);
+	g_io_channel_unref(w->gio);
+	g_free(w);
+}
+
+static void
+dhcpcd_wpa_watch_command(DHCPCD_WPA *wpa)
+{
+	struct watch *w;
+	int fd;
+
+	fd = dhcpcd_wpa_get_command_fd(wpa);
+	for (w = command_watches; w; w = w->next) {
+		if (w->ref == wpa && w->fd == fd)
+			return;
+	}
+	dhcpcd_wpa_unwatch_command(wpa);
+	if (fd == -1)
+		return;
+
+	w = g_try_malloc(sizeof(*w));
+	if (w == NULL) {
+		g_warning(_("g_try_malloc\n"));
+		return;
+	}
+	w->gio = g_io_channel_unix_new(fd);
+	if (w->gio == NULL) {
+		g_warning(_("Error creating new GIO Channel\n"));
+		g_free(w);
+		return;
+	}
+	w->eventid = g_io_add_watch(w->gio, G_IO_IN,
+	    dhcpcd_wpa_command_cb, wpa);
+	w->ref = wpa;
+	w->fd = fd;
+	w->next = command_watches;
+	command_watches = w;
+}
+
 static gboolean
 dhcpcd_wpa_cb(_unused GIOChannel *gio, _unused GIOCondition c,
     gpointer data)
@@ -542,6 +794,7 @@ dhcpcd_wpa_cb(_unused GIOChannel *gio, _unused GIOCondition c,
 	wpa = (DHCPCD_WPA *)data;
 	if (dhcpcd_wpa_get_fd(wpa) == -1) {
 		dhcpcd_unwatch(-1, wpa);
+		dhcpcd_wpa_unwatch_command(wpa);
 
 		/* If the interface hasn't left, try re-opening */
 		i = dhcpcd_wpa_if(wpa);
@@ -554,6 +807,7 @@ dhcpcd_wpa_cb(_unused GIOChannel *gio, _unused GIOCondition c,
 	}
 
 	dhcpcd_wpa_dispatch(wpa);
+	dhcpcd_arm_timeout(dhcpcd_wpa_connection(wpa));
 	return TRUE;
 }
 
@@ -577,6 +831,7 @@ dhcpcd_wpa_try_open(gpointer data)
 		dhcpcd_wpa_close(wpa);
 		return TRUE;
 	}
+	dhcpcd_wpa_watch_command(wpa);
 
 	return FALSE;
 }
@@ -598,6 +853,9 @@ dhcpcd_wpa_scan_cb(DHCPCD_WPA *wpa, _unused void *data)
 		return;
 	}
 	dhcpcd_watch(fd, dhcpcd_wpa_cb, wpa);
+	dhcpcd_wpa_watch_command(wpa);
+	/* Scan and check wpa_supplicant is alive if it's quiet */
+	dhcpcd_arm_timeout(dhcpcd_wpa_connection(wpa));
 
 	i = dhcpcd_wpa_if(wpa);
 	if (i == NULL) {
@@ -677,6 +935,7 @@ dhcpcd_wpa_status_cb(DHCPCD_WPA *wpa,
 	g_message("%s: WPA status %s", i->ifname, status_msg);
 	if (status == DHC_DOWN) {
 		dhcpcd_unwatch(-1, wpa);
+		dhcpcd_wpa_unwatch_command(wpa);
 		TAILQ_FOREACH_SAFE(w, &wi_scans, next, wn) {
 			if (w->interface == i) {
 				TAILQ_REMOVE(&wi_scans, w, next);
@@ -688,27 +947,6 @@ dhcpcd_wpa_status_cb(DHCPCD_WPA *wpa,
 	}
 }
 
-static gboolean
-bgscan(gpointer data)
-{
-	WI_SCAN *w;
-	DHCPCD_CONNECTION *con;
-	DHCPCD_WPA *wpa;
-
-	con = (DHCPCD_CONNECTION *)data;
-	TAILQ_FOREACH(w, &wi_scans, next) {
-		if (w->interface->wireless) {
-			wpa = dhcpcd_wpa_find(con, w->interface->ifname);
-			if (wpa &&
-			    (!w->interface->up ||
-			    dhcpcd_wpa_can_background_scan(wpa)))
-				dhcpcd_wpa_scan(wpa);
-		}
-	}
-
-	return TRUE;
-}
-
 int
 main(int argc, char *argv[])
 {
@@ -743,13 +981,12 @@ main(int argc, char *argv[])
 	dhcpcd_set_progname(con, "dhcpcd-gtk");
 	dhcpcd_set_status_callback(con, dhcpcd_status_cb, NULL);
 	dhcpcd_set_if_callback(con, dhcpcd_if_cb, NULL);
+	dhcpcd_set_damping(con, DHCPCD_DAMPING);
 	dhcpcd_wpa_set_scan_callback(con, dhcpcd_wpa_scan_cb, NULL);
 	dhcpcd_wpa_set_status_callback(con, dhcpcd_wpa_status_cb, NULL);
-	if (dhcpcd_try_open(con))
-		g_timeout_add(DHCPCD_RETRYOPEN, dhcpcd_try_open, con);
+	dhcpcd_try_open(con);
 
 	menu_init(status_icon, con);
-	g_timeout_add(DHCPCD_WPA_SCAN_LONG, bgscan, con);
 
 	gtk_main();
 	dhcpcd_close(con);
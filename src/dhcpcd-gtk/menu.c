@@ -32,7 +32,6 @@ static const char *copyright = "Copyright (c) 2009-2015 Roy Marples";
 static GtkStatusIcon *sicon;
 static GtkWidget *menu;
 static GtkAboutDialog *about;
-static guint bgscan_timer;
 
 static void
 on_pref(_unused GObject *o, gpointer data)
@@ -327,16 +326,39 @@ add_scans(WI_SCAN *wi)
 	return m;
 }
 
+/* libdhcpcd scans more often while the user can see the results */
+static void
+menu_set_open(bool open)
+{
+	WI_SCAN *w;
+	DHCPCD_CONNECTION *con;
+	DHCPCD_WPA *wpa;
+
+	con = NULL;
+	TAILQ_FOREACH(w, &wi_scans, next) {
+		con = dhcpcd_if_connection(w->interface);
+		wpa = dhcpcd_wpa_find(con, w->interface->ifname);
+		if (wpa)
+			dhcpcd_wpa_set_menu_open(wpa, open);
+	}
+	if (con)
+		dhcpcd_arm_timeout(con);
+}
+
+static void
+on_deactivate(_unused GtkMenuShell *shell, _unused gpointer data)
+{
+
+	menu_set_open(false);
+}
+
 void
 menu_abort(void)
 {
 	WI_SCAN *wis;
 	WI_MENU *wim;
 
-	if (bgscan_timer) {
-		g_source_remove(bgscan_timer);
-		bgscan_timer = 0;
-	}
+	menu_set_open(false);
 
 	TAILQ_FOREACH(wis, &wi_scans, next) {
 		wis->ifmenu = NULL;
@@ -354,32 +376,6 @@ menu_abort(void)
 	}
 }
 
-static gboolean
-menu_bgscan(gpointer data)
-{
-	WI_SCAN *w;
-	DHCPCD_CONNECTION *con;
-	DHCPCD_WPA *wpa;
-
-	if (menu == NULL || !gtk_widget_get_visible(menu)) {
-		bgscan_timer = 0;
-		return FALSE;
-	}
-
-	con = (DHCPCD_CONNECTION *)data;
-	TAILQ_FOREACH(w, &wi_scans, next) {
-		if (w->interface->wireless && w->interface->up) {
-			wpa = dhcpcd_wpa_find(con, w->interface->ifname);
-			if (wpa &&
-			    (!w->interface->up ||
-			    dhcpcd_wpa_can_background_scan(wpa)))
-				dhcpcd_wpa_scan(wpa);
-		}
-	}
-
-	return TRUE;
-}
-
 static void
 on_activate(GtkStatusIcon *icon)
 {
@@ -417,9 +413,9 @@ on_activate(GtkStatusIcon *icon)
 		gtk_menu_popup(GTK_MENU(menu), NULL, NULL,
 		    gtk_status_icon_position_menu, icon,
 		    1, gtk_get_current_event_time());
-
-		bgscan_timer = g_timeout_add(DHCPCD_WPA_SCAN_SHORT,
-		    menu_bgscan, dhcpcd_if_connection(w->interface));
+		g_signal_connect(G_OBJECT(menu), "deactivate",
+		    G_CALLBACK(on_deactivate), NULL);
+		menu_set_open(true);
 	}
 }
 
@@ -427,6 +427,30 @@ on_clear(_unused GtkWidget *o, gpointer data)
 		g_critical("dhcpcd_config_write: %s", strerror(errno));
 }
 
+static void
+on_rebound(_unused DHCPCD_CONNECTION *con, int error,
+    _unused const char *data, _unused size_t len, void *arg)
+{
+	char *ifname = arg;
+
+	if (error != 0)
+		g_critical("dhcpcd_rebind %s: %s", ifname, strerror(error));
+	g_free(ifname);
+}
+
+static void
+rebind_if(DHCPCD_CONNECTION *con, const char *ifname)
+{
+	char *arg;
+
+	/* The reply comes back through the command watch */
+	arg = g_strdup(ifname);
+	if (dhcpcd_rebind_async(con, ifname, on_rebound, arg) == -1) {
+		g_critical("dhcpcd_rebind %s: %s", ifname, strerror(errno));
+		g_free(arg);
+	}
+}
+
 static void
 on_rebind(_unused GObject *widget, gpointer data)
 {
@@ -438,19 +462,12 @@ on_rebind(_unused GObject *widget, gpointer data)
 		set_name_active_icon(config == NULL ?
 		    "document-new" : "document-save");
 		show_config(config);
-		if (g_strcmp0(block, "interface") == 0) {
-			if (dhcpcd_rebind(con, iface->ifname) == -1)
-				g_critical("dhcpcd_rebind %s: %s",
-				    iface->ifname, strerror(errno));
-		} else {
+		if (g_strcmp0(block, "interface") == 0)
+			rebind_if(con, iface->ifname);
+		else {
 			for (i = dhcpcd_interfaces(con); i; i = i->next) {
-				if (g_strcmp0(i->ssid, name) == 0) {
-					if (dhcpcd_rebind(con, i->ifname) == -1)
-						g_critical(
-						    "dhcpcd_rebind %s: %s",
-						    i->ifname,
-						    strerror(errno));
-				}
+				if (g_strcmp0(i->ssid, name) == 0)
+					rebind_if(con, i->ifname);
 			}
 		}
 	}
@@ -113,6 +113,8 @@ main(int argc, char **argv)
 	bool xflag;
 	struct timespec now, end, t;
 	struct ctx ctx;
+	struct pollfd waitfd;
+	bool waiting;
 	int timeout, n, error, lerrno;
 	long lnum;
 	char *lend;
@@ -161,12 +163,18 @@ main(int argc, char **argv)
 	}
 	dhcpcd_set_status_callback(con, status_cb, &ctx);
 
+	/* Watch for the socket before trying it so we can't miss it */
+	waitfd.fd = dhcpcd_wait_start(con);
+	waitfd.events = POLLIN;
+	waiting = true;
 	if ((ctx.pollfd.fd = dhcpcd_open(con)) == -1) {
 		lerrno = errno;
 		syslog(LOG_WARNING, "dhcpcd_open: %m");
 		if (xflag)
 			do_exit(con, EXIT_FAILURE);
 	} else {
+		dhcpcd_wait_stop(con);
+		waiting = false;
 		error = dhcpcd_error(con);
 		if (error != 0) {
 			lerrno = errno = error;
@@ -194,31 +202,43 @@ main(int argc, char **argv)
 			syslog(LOG_ERR, "timed out");
 			do_exit(con, EXIT_FAILURE);
 		}
-		if (ctx.pollfd.fd == -1) {
-			n = poll(NULL, 0, DHCPCD_RETRYOPEN);
-		} else {
-			/* poll(2) should really take a timespec */
-			timespecsub(&end, &now, &t);
-			if (t.tv_sec > INT_MAX / 1000 ||
-			    (t.tv_sec == INT_MAX / 1000 &&
-			    (t.tv_nsec + 999999) / 1000000 > INT_MAX % 1000000))
-				timeout = INT_MAX;
-			else
-				timeout = (int)(t.tv_sec * 1000 +
-				    (t.tv_nsec + 999999) / 1000000);
+		/* poll(2) should really take a timespec */
+		timespecsub(&end, &now, &t);
+		if (t.tv_sec > INT_MAX / 1000 ||
+		    (t.tv_sec == INT_MAX / 1000 &&
+		    (t.tv_nsec + 999999) / 1000000 > INT_MAX % 1000000))
+			timeout = INT_MAX;
+		else
+			timeout = (int)(t.tv_sec * 1000 +
+			    (t.tv_nsec + 999999) / 1000000);
+		if (ctx.pollfd.fd == -1 && !waiting) {
+			/* Lost dhcpcd, so watch for it and try it now */
+			waitfd.fd = dhcpcd_wait_start(con);
+			waiting = true;
+			n = 0;
+		} else if (ctx.pollfd.fd == -1) {
+			/* Wait for the dhcpcd socket to appear */
+			n = dhcpcd_wait_timeout(con);
+			if (n != -1 && n < timeout)
+				timeout = n;
+			n = poll(&waitfd, waitfd.fd == -1 ? 0 : 1, timeout);
+		} else
 			n = poll(&ctx.pollfd, 1, timeout);
-		}
 		if (n == -1) {
 			syslog(LOG_ERR, "poll: %m");
 			do_exit(con, EXIT_FAILURE);
 		}
 		if (ctx.pollfd.fd == -1) {
+			if (n > 0 && !dhcpcd_wait_dispatch(con))
+				continue;
 			if ((ctx.pollfd.fd = dhcpcd_open(con)) == -1) {
 				if (lerrno != errno) {
 					lerrno = errno;
 					syslog(LOG_WARNING, "dhcpcd_open: %m");
 				}
 			} else {
+				dhcpcd_wait_stop(con);
+				waiting = false;
 				error = dhcpcd_error(con);
 				if (error != 0 && lerrno != errno) {
 					lerrno = errno;
@@ -227,7 +247,7 @@ main(int argc, char **argv)
 			}
 		} else {
 			if (n > 0 && ctx.pollfd.revents)
-				dhcpcd_dispatch(con);
+				dhcpcd_dispatch_all(con);
 		}
 	}
 
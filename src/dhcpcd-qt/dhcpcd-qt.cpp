@@ -51,7 +51,15 @@ DhcpcdQt::DhcpcdQt()
 	aniTimer = new QTimer(this);
 	connect(aniTimer, SIGNAL(timeout()), this, SLOT(animate()));
 	notifier = NULL;
-	retryOpenTimer = NULL;
+	waitNotifier = NULL;
+	wpaDirNotifier = NULL;
+	retryOpenTimer = new QTimer(this);
+	retryOpenTimer->setSingleShot(true);
+	connect(retryOpenTimer, SIGNAL(timeout()), this, SLOT(tryOpen()));
+	lastError = 0;
+	dampTimer = new QTimer(this);
+	dampTimer->setSingleShot(true);
+	connect(dampTimer, SIGNAL(timeout()), this, SLOT(dispatchTimeout()));
 
 	about = NULL;
 	preferences = NULL;
@@ -69,6 +77,7 @@ DhcpcdQt::DhcpcdQt()
 	dhcpcd_set_progname(con, "dhcpcd-qt");
 	dhcpcd_set_status_callback(con, dhcpcd_status_cb, this);
 	dhcpcd_set_if_callback(con, dhcpcd_if_cb, this);
+	dhcpcd_set_damping(con, DHCPCD_DAMPING);
 	dhcpcd_wpa_set_scan_callback(con, dhcpcd_wpa_scan_cb, this);
 	dhcpcd_wpa_set_status_callback(con, dhcpcd_wpa_status_cb, this);
 	tryOpen();
@@ -201,7 +210,7 @@ void DhcpcdQt::animate()
 void DhcpcdQt::updateOnline(bool showIf)
 {
 	bool isOn, isCarrier;
-	char *msg;
+	const char *msg;
 	DHCPCD_IF *ifs, *i;
 	QString msgs;
 
@@ -215,7 +224,7 @@ void DhcpcdQt::updateOnline(bool showIf)
 			if (i->up)
 				isOn = true;
 		}
-		msg = dhcpcd_if_message(i, NULL);
+		msg = dhcpcd_if_get_message(i, NULL);
 		if (msg) {
 			if (showIf)
 				qDebug("%s", msg);
@@ -223,7 +232,6 @@ void DhcpcdQt::updateOnline(bool showIf)
 				msgs = QString::fromLatin1(msg);
 			else
 				msgs += '\n' + QString::fromLatin1(msg);
-			free(msg);
 		} else if (showIf)
 			qDebug("%s: %s", i->ifname, i->reason);
 	}
@@ -284,14 +292,8 @@ void DhcpcdQt::statusCallback(unsigned int status, const char *status_msg)
 
 	lastStatus = status;
 
-	if (status == DHC_DOWN) {
-		if (retryOpenTimer == NULL) {
-			retryOpenTimer = new QTimer(this);
-			connect(retryOpenTimer, SIGNAL(timeout()),
-			    this, SLOT(tryOpen()));
-			retryOpenTimer->start(DHCPCD_RETRYOPEN);
-		}
-	}
+	if (status == DHC_DOWN)
+		retryOpenTimer->start(0);
 }
 
 void DhcpcdQt::dhcpcd_status_cb(_unused DHCPCD_CONNECTION *con,
@@ -304,13 +306,13 @@ void DhcpcdQt::dhcpcd_status_cb(_unused DHCPCD_CONNECTION *con,
 
 void DhcpcdQt::ifCallback(DHCPCD_IF *i)
 {
-	char *msg;
+	const char *msg;
 	bool new_msg;
 
 	if (i->state == DHS_RENEW ||
 	    i->state == DHS_STOP || i->state == DHS_STOPPED)
 	{
-		msg = dhcpcd_if_message(i, &new_msg);
+		msg = dhcpcd_if_get_message(i, &new_msg);
 		if (msg) {
 			qDebug("%s", msg);
 			if (new_msg) {
@@ -326,7 +328,6 @@ void DhcpcdQt::ifCallback(DHCPCD_IF *i)
 					icon = "network-offline";
 				notify(t, m, icon);
 			}
-			free(msg);
 		}
 	}
 
@@ -483,43 +484,100 @@ void DhcpcdQt::dhcpcd_wpa_status_cb(DHCPCD_WPA *wpa,
 	dhcpcdQt->wpaStatusCallback(wpa, status, status_msg);
 }
 
-void DhcpcdQt::tryOpen() {
-	int fd = dhcpcd_open(con), error;
-	static int last_error;
+void DhcpcdQt::openError()
+{
 	const char *errt;
+	int ms;
+
+	if (errno != lastError) {
+		lastError = errno;
+		errt = strerror(errno);
+		qCritical("dhcpcd_open: %s", errt);
+		trayIcon->setToolTip(
+		    tr("Error connecting to dhcpcd: %1").arg(errt));
+	}
+
+	/* Otherwise we wait for the dhcpcd socket to appear */
+	ms = dhcpcd_wait_timeout(con);
+	if (ms != -1)
+		retryOpenTimer->start(ms);
+}
+
+void DhcpcdQt::waitDispatch()
+{
+
+	if (dhcpcd_wait_dispatch(con))
+		tryOpen();
+}
 
+void DhcpcdQt::wpaDirDispatch()
+{
+
+	dhcpcd_wpa_dir_dispatch(con);
+	armTimeout();
+}
+
+void DhcpcdQt::tryOpen() {
+	int fd;
+
+	retryOpenTimer->stop();
+	/* Already opening */
+	if (notifier != NULL)
+		return;
+
+	/* Watch for the socket before trying it so we can't miss it */
+	if (waitNotifier == NULL && (fd = dhcpcd_wait_start(con)) != -1) {
+		waitNotifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+		connect(waitNotifier, SIGNAL(activated(int)),
+		    this, SLOT(waitDispatch()));
+	}
+
+	fd = dhcpcd_open_start(con);
 	if (fd == -1) {
-		if (errno != last_error) {
-		        last_error = errno;
-			errt = strerror(errno);
-			qCritical("dhcpcd_open: %s", errt);
-			trayIcon->setToolTip(
-			    tr("Error connecting to dhcpcd: %1").arg(errt));
-		}
-		if (retryOpenTimer == NULL) {
-			retryOpenTimer = new QTimer(this);
-			connect(retryOpenTimer, SIGNAL(timeout()),
-			    this, SLOT(tryOpen()));
-			retryOpenTimer->start(DHCPCD_RETRYOPEN);
-		}
+		openError();
 		return;
 	}
 
 	notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
-	connect(notifier, SIGNAL(activated(int)), this, SLOT(dispatch()));
+	connect(notifier, SIGNAL(activated(int)), this, SLOT(openDispatch()));
+}
 
-	preferencesAction->setEnabled(dhcpcd_privileged(con));
+void DhcpcdQt::openDispatch()
+{
+	int r = dhcpcd_open_dispatch(con), error, fd;
+	const char *errt;
 
-	if (retryOpenTimer != NULL) {
-		retryOpenTimer->stop();
-		retryOpenTimer->deleteLater();
-		retryOpenTimer = NULL;
+	if (r == 0)
+		return;
+	/* A failure will have closed us down already */
+	if (notifier) {
+		notifier->setEnabled(false);
+		notifier->deleteLater();
+		notifier = NULL;
+	}
+	if (r == -1) {
+		openError();
+		return;
 	}
 
+	qDebug("Opened dhcpcd in %ums", dhcpcd_open_time(con));
+	if (waitNotifier) {
+		waitNotifier->setEnabled(false);
+		waitNotifier->deleteLater();
+		waitNotifier = NULL;
+	}
+	dhcpcd_wait_stop(con);
+
+	notifier = new QSocketNotifier(dhcpcd_get_fd(con),
+	    QSocketNotifier::Read);
+	connect(notifier, SIGNAL(activated(int)), this, SLOT(dispatch()));
+
+	preferencesAction->setEnabled(dhcpcd_privileged(con));
+
 	error = dhcpcd_error(con);
 	if (error != 0) {
-		if (error != last_error) {
-			last_error = error;
+		if (error != lastError) {
+			lastError = error;
 			errt = strerror(error);
 			qCritical("dhcpcd_error: %s", errt);
 			trayIcon->setToolTip(
@@ -531,12 +589,36 @@ void DhcpcdQt::tryOpen() {
 
 	/* Start listening to WPA events */
 	dhcpcd_wpa_start(con);
+	if (wpaDirNotifier == NULL && (fd = dhcpcd_wpa_get_dir_fd(con)) != -1) {
+		wpaDirNotifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+		connect(wpaDirNotifier, SIGNAL(activated(int)),
+		    this, SLOT(wpaDirDispatch()));
+	}
+}
+
+void DhcpcdQt::armTimeout()
+{
+	int ms;
+
+	ms = dhcpcd_get_timeout(con);
+	if (ms == -1)
+		dampTimer->stop();
+	else
+		dampTimer->start(ms);
 }
 
 void DhcpcdQt::dispatch()
 {
 
-	dhcpcd_dispatch(con);
+	dhcpcd_dispatch_all(con);
+	armTimeout();
+}
+
+void DhcpcdQt::dispatchTimeout()
+{
+
+	dhcpcd_dispatch_timeout(con);
+	armTimeout();
 }
 
 void DhcpcdQt::notify(const QString &title, const QString &msg,
@@ -77,14 +77,19 @@ public:
 	void closeAbout();
 	void dialogClosed(QDialog *dialog);
 	void menuDeleted(QMenu *menu);
+	void armTimeout();
 
 protected:
 	void closeEvent(QCloseEvent *event);
 
 private slots:
 	void tryOpen();
+	void openDispatch();
+	void waitDispatch();
+	void wpaDirDispatch();
 	void animate();
 	void dispatch();
+	void dispatchTimeout();
 	void showAbout();
 	void showPreferences();
 	void iconActivated(QSystemTrayIcon::ActivationReason reason);
@@ -92,7 +97,12 @@ private slots:
 private:
 	DHCPCD_CONNECTION *con;
 	QSocketNotifier *notifier;
+	QSocketNotifier *waitNotifier;
+	QSocketNotifier *wpaDirNotifier;
 	QTimer *retryOpenTimer;
+	int lastError;
+	void openError();
+	QTimer *dampTimer;
 	QList<DhcpcdWi *> *wis;
 	DhcpcdWi *findWi(DHCPCD_WPA *wpa);
 
@@ -31,7 +31,6 @@
 #include <QMenu>
 #include <QMessageBox>
 #include <QSocketNotifier>
-#include <QTimer>
 #include <QWidgetAction>
 
 #include <cerrno>
@@ -53,8 +52,7 @@ DhcpcdWi::DhcpcdWi(DhcpcdQt *parent, DHCPCD_WPA *wpa)
 	ssid = NULL;
 
 	notifier = NULL;
-	pingTimer = NULL;
-	scanTimer = NULL;
+	commandNotifier = NULL;
 }
 
 DhcpcdWi::~DhcpcdWi()
@@ -72,20 +70,15 @@ DhcpcdWi::~DhcpcdWi()
 		notifier = NULL;
 	}
 
-	if (pingTimer) {
-		pingTimer->deleteLater();
-		pingTimer = NULL;
+	if (commandNotifier) {
+		commandNotifier->deleteLater();
+		commandNotifier = NULL;
 	}
 
 	if (ssid) {
 		ssid->deleteLater();
 		ssid = NULL;
 	}
-
-	if (scanTimer) {
-		scanTimer->deleteLater();
-		scanTimer = NULL;
-	}
 }
 
 DHCPCD_WPA *DhcpcdWi::getWpa()
@@ -242,12 +235,12 @@ bool DhcpcdWi::open()
 
 	notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
 	connect(notifier, SIGNAL(activated(int)), this, SLOT(dispatch()));
-	pingTimer = new QTimer(this);
-	connect(pingTimer, SIGNAL(timeout()), this, SLOT(ping()));
-	pingTimer->start(DHCPCD_WPA_PING);
-	scanTimer = new QTimer(this);
-	connect(scanTimer, SIGNAL(timeout()), this, SLOT(scan()));
-	scanTimer->start(DHCPCD_WPA_SCAN_LONG);
+	commandNotifier = new QSocketNotifier(dhcpcd_wpa_get_command_fd(wpa),
+	    QSocketNotifier::Read);
+	connect(commandNotifier, SIGNAL(activated(int)),
+	    this, SLOT(commandDispatch()));
+	/* Scan and check wpa_supplicant is alive if it's quiet */
+	dhcpcdQt->armTimeout();
 	return true;
 }
 
@@ -260,15 +253,12 @@ void DhcpcdWi::close()
 	if (notifier)
 		notifier->setEnabled(false);
 
-	if (pingTimer)
-		pingTimer->stop();
+	if (commandNotifier)
+		commandNotifier->setEnabled(false);
 
 	if (ssid)
 		ssid->reject();
 
-	if (scanTimer)
-		scanTimer->stop();
-
 	if (scans) {
 		dhcpcd_wi_scans_free(scans);
 		scans = NULL;
@@ -283,13 +273,13 @@ void DhcpcdWi::dispatch()
 {
 
 	dhcpcd_wpa_dispatch(wpa);
+	dhcpcdQt->armTimeout();
 }
 
-void DhcpcdWi::ping()
+void DhcpcdWi::commandDispatch()
 {
 
-	if (!dhcpcd_wpa_ping(wpa))
-		dhcpcd_wpa_close(wpa);
+	dhcpcd_wpa_command_dispatch(wpa);
 }
 
 void DhcpcdWi::connectSsid(DHCPCD_WI_SCAN *scan)
@@ -368,29 +358,21 @@ void DhcpcdWi::connectSsid(DHCPCD_WI_SCAN *scan)
 	    errt);
 }
 
-void DhcpcdWi::scan()
-{
-	DHCPCD_IF *i;
-
-	i = dhcpcd_wpa_if(wpa);
-	if (!i->up || dhcpcd_wpa_can_background_scan(wpa))
-		dhcpcd_wpa_scan(wpa);
-}
-
 void DhcpcdWi::menuHidden()
 {
 
-	if (scanTimer) {
-		scanTimer->stop();
-		scanTimer->start(DHCPCD_WPA_SCAN_LONG);
+	if (wpa) {
+		dhcpcd_wpa_set_menu_open(wpa, false);
+		dhcpcdQt->armTimeout();
 	}
 }
 
 void DhcpcdWi::menuShown()
 {
 
-	if (scanTimer) {
-		scanTimer->stop();
-		scanTimer->start(DHCPCD_WPA_SCAN_SHORT);
+	if (wpa) {
+		/* libdhcpcd scans more often while the results are seen */
+		dhcpcd_wpa_set_menu_open(wpa, true);
+		dhcpcdQt->armTimeout();
 	}
 }
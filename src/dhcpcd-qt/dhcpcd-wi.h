@@ -34,7 +34,6 @@
 
 class QMenu;
 class QSocketNotifier;
-class QTimer;
 class QWidgetAction;
 
 class DhcpcdQt;
@@ -60,9 +59,8 @@ public:
 
 private slots:
 	void dispatch();
-	void ping();
+	void commandDispatch();
 	void connectSsid(DHCPCD_WI_SCAN *scan);
-	void scan();
 	void menuHidden();
 	void menuShown();
 
@@ -73,8 +71,7 @@ private:
 	DhcpcdSsid *ssid;
 
 	QSocketNotifier *notifier;
-	QTimer *pingTimer;
-	QTimer *scanTimer;
+	QSocketNotifier *commandNotifier;
 
 	QMenu *menu;
 	void createMenuItem(QMenu *menu, DHCPCD_WI_SCAN *scan,
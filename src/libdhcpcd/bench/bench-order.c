@@ -0,0 +1,179 @@
+/*
+ * libdhcpcd
+ * Copyright 2009-2015 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Feed dhcpcd_new_if synthetic events for 1k and 10k interfaces and
+ * time placing them in interface_order. dhcpcd sends the whole order
+ * with every event, so we do too.
+ * The source is included to reach its static functions.
+ */
+
+#include "../dhcpcd.c"
+
+#include <err.h>
+#include <time.h>
+
+#define	BENCH_REORDER		100
+
+static uint64_t
+bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* A CARRIER event for ifname, as dhcpcd would send it. */
+static char *
+bench_event(const char *ifname, const char *order, size_t olen, size_t *lenp)
+{
+	static const char mid[] = "\0reason=CARRIER\0if_up=true\0"
+	    "interface_order=";
+	static const char pre[] = "interface=";
+	size_t nlen, len;
+	char *data, *p;
+
+	nlen = strlen(ifname);
+	len = sizeof(pre) - 1 + nlen + sizeof(mid) - 1 + olen;
+	if ((data = malloc(len + 1)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	p = data;
+	memcpy(p, pre, sizeof(pre) - 1);
+	p += sizeof(pre) - 1;
+	memcpy(p, ifname, nlen);
+	p += nlen;
+	memcpy(p, mid, sizeof(mid) - 1);
+	p += sizeof(mid) - 1;
+	memcpy(p, order, olen + 1);
+	*lenp = len;
+	return data;
+}
+
+/* Time one event, returning nanoseconds. */
+static uint64_t
+bench_add(DHCPCD_CONNECTION *con, const char *ifname,
+    const char *order, size_t olen)
+{
+	char *data;
+	size_t len;
+	uint64_t t;
+
+	data = bench_event(ifname, order, olen, &len);
+	t = bench_ns();
+	if (dhcpcd_add_if(con, data, len) == NULL)
+		errx(EXIT_FAILURE, "%s: not added", ifname);
+	return bench_ns() - t;
+}
+
+static void
+bench_check(DHCPCD_CONNECTION *con, size_t n)
+{
+	DHCPCD_IF *i;
+	size_t count;
+
+	count = 0;
+	for (i = con->interfaces; i; i = i->next) {
+		if (i->next && i->next->order_rank <= i->order_rank)
+			errx(EXIT_FAILURE, "%s is out of order", i->ifname);
+		count++;
+	}
+	if (count != n)
+		errx(EXIT_FAILURE, "%zu interfaces, expected %zu", count, n);
+}
+
+static void
+bench(size_t n)
+{
+	DHCPCD_CONNECTION *con;
+	char **names, *order, *swapped, *p;
+	size_t k, olen;
+	uint64_t add, update, reorder;
+
+	names = calloc(n, sizeof(*names));
+	order = malloc(n * 8);
+	swapped = malloc(n * 8);
+	if (names == NULL || order == NULL || swapped == NULL)
+		err(EXIT_FAILURE, "malloc");
+	p = order;
+	for (k = 0; k < n; k++) {
+		if (asprintf(&names[k], "eth%zu", k) == -1)
+			err(EXIT_FAILURE, "asprintf");
+		p += sprintf(p, "%s%s", k == 0 ? "" : " ", names[k]);
+	}
+	olen = (size_t)(p - order);
+	/* The same order with the first two swapped */
+	snprintf(swapped, n * 8, "%s %s%s", names[1], names[0],
+	    order + strlen(names[0]) + strlen(names[1]) + 1);
+
+	con = dhcpcd_new();
+	if (con == NULL)
+		err(EXIT_FAILURE, "dhcpcd_new");
+
+	/* Each interface appears */
+	add = 0;
+	for (k = 0; k < n; k++)
+		add += bench_add(con, names[k], order, olen);
+	bench_check(con, n);
+
+	/* Then changes state in no particular order */
+	srandom(1);
+	update = 0;
+	for (k = 0; k < n; k++)
+		update += bench_add(con, names[(size_t)random() % n],
+		    order, olen);
+	bench_check(con, n);
+
+	/* And the order changes back and forth */
+	reorder = 0;
+	for (k = 0; k < BENCH_REORDER; k++)
+		reorder += bench_add(con, names[k % n],
+		    k % 2 ? order : swapped, olen);
+	bench_check(con, n);
+
+	printf("%6zu interfaces: add %8.2f us, update %8.2f us, "
+	    "reorder %8.2f us per event\n", n,
+	    (double)add / (double)n / 1000.0,
+	    (double)update / (double)n / 1000.0,
+	    (double)reorder / BENCH_REORDER / 1000.0);
+
+	dhcpcd_close(con);
+	dhcpcd_free(con);
+	for (k = 0; k < n; k++)
+		free(names[k]);
+	free(names);
+	free(order);
+	free(swapped);
+}
+
+int
+main(void)
+{
+
+	bench(1000);
+	bench(10000);
+	return EXIT_SUCCESS;
+}
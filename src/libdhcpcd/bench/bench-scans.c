@@ -0,0 +1,146 @@
+/*
+ * libdhcpcd
+ * Copyright 2009-2015 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Build scan results from a table of 1000 synthetic BSS, as frontends
+ * do on every scan, and count the heap allocations it takes.
+ * Once the tables have grown and the signal history has been made,
+ * each batch should be one allocation however many BSS there are.
+ * The source is included to reach its static functions.
+ */
+
+#include "../wpa.c"
+
+#include <err.h>
+#include <time.h>
+
+#define	BENCH_BSS		1000
+#define	BENCH_BATCHES		1000
+
+static const char * const bench_flags[] = {
+	"[WPA2-PSK-CCMP][ESS]",
+	"[WPA-PSK-TKIP][WPA2-PSK-CCMP+TKIP-preauth][WPS][ESS]",
+	"[WPA2-SAE-EXT-KEY-CCMP][ESS]",
+	"[ESS]",
+};
+
+static uint64_t
+bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* As a refresh would after each scan */
+static void
+bench_signal(DHCPCD_WPA *wpa)
+{
+	size_t k;
+
+	for (k = 0; k < wpa->bss_len; k++) {
+		wpa->bss[k].level = -40 - (int)(random() % 50);
+		wpa->bss[k].strength =
+		    dhcpcd_wpa_scan_strength(wpa->bss[k].level);
+	}
+}
+
+int
+main(void)
+{
+	DHCPCD_CONNECTION *con;
+	DHCPCD_WPA *wpa;
+	DHCPCD_WPA_BSS b;
+	DHCPCD_IF i;
+	DHCPCD_WI_SCAN *wis, *w;
+	const DHCPCD_WPA_SCAN_STATS *stats;
+	unsigned long allocs, batches;
+	size_t k, nscans;
+	uint64_t t;
+
+	if ((con = dhcpcd_new()) == NULL ||
+	    (wpa = dhcpcd_wpa_new(con, "wlan0")) == NULL)
+		err(EXIT_FAILURE, "dhcpcd_new");
+	memset(&i, 0, sizeof(i));
+	i.con = con;
+	i.ifname = wpa->ifname;
+
+	srandom(1);
+	for (k = 0; k < BENCH_BSS; k++) {
+		memset(&b, 0, sizeof(b));
+		b.id = (unsigned int)k;
+		b.bssid_set = true;
+		b.bssid[0] = 0x02;
+		b.bssid[4] = (uint8_t)(k >> 8);
+		b.bssid[5] = (uint8_t)k;
+		b.ssid_len = (uint8_t)snprintf((char *)b.ssid, sizeof(b.ssid),
+		    "%s%ld", random() % 2 ? "Net" : "net", random() % 300);
+		b.frequency = random() % 2 ? 2412 : 5180;
+		b.text = dhcpcd_wpa_flags_get(wpa,
+		    bench_flags[k % __arraycount(bench_flags)]);
+		if (b.text == NULL || dhcpcd_wpa_bss_add(wpa, &b) == -1)
+			err(EXIT_FAILURE, "dhcpcd_wpa_bss_add");
+		dhcpcd_wpa_flags_put(wpa, b.text);
+	}
+	wpa->bss_loaded = true;
+	bench_signal(wpa);
+
+	stats = dhcpcd_wpa_scan_stats(wpa);
+	allocs = stats->allocs;
+	if ((wis = dhcpcd_wi_scans(&i)) == NULL)
+		errx(EXIT_FAILURE, "no scan results");
+	nscans = 0;
+	for (w = wis; w; w = w->next)
+		nscans++;
+	dhcpcd_wi_scans_free(wis);
+	printf("%d BSS in %zu scans\n", BENCH_BSS, nscans);
+	printf("first batch:  %lu allocations\n", stats->allocs - allocs);
+
+	allocs = stats->allocs;
+	batches = stats->batches;
+	t = 0;
+	for (k = 0; k < BENCH_BATCHES; k++) {
+		bench_signal(wpa);
+		t -= bench_ns();
+		wis = dhcpcd_wi_scans(&i);
+		dhcpcd_wi_scans_free(wis);
+		t += bench_ns();
+	}
+	printf("steady state: %.2f allocations per batch, "
+	    "%.4f per BSS, %.1f us per batch\n",
+	    (double)(stats->allocs - allocs) /
+	    (double)(stats->batches - batches),
+	    (double)(stats->allocs - allocs) /
+	    (double)(stats->batches - batches) / BENCH_BSS,
+	    (double)t / BENCH_BATCHES / 1000.0);
+
+	/* We never opened it, so closing won't free the table */
+	dhcpcd_wpa_bss_free(wpa);
+	dhcpcd_close(con);
+	dhcpcd_free(con);
+	return EXIT_SUCCESS;
+}
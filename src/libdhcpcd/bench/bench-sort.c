@@ -0,0 +1,124 @@
+/*
+ * libdhcpcd
+ * Copyright 2009-2015 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Sort 1000 synthetic BSS on precomputed keys, as dhcpcd_wi_scans does,
+ * against sorting the same scans with dhcpcd_wi_scan_compare, which
+ * case folds and compares the escaped SSIDs on every comparison.
+ * Both orders are checked to agree.
+ * The source is included to reach its static functions.
+ */
+
+#include "../wpa.c"
+
+#include <err.h>
+#include <time.h>
+
+#define	BENCH_BSS		1000
+#define	BENCH_SORTS		1000
+
+static const char * const bench_prefixes[] = {
+	"HomeNetwork", "homenetwork", "HOMENETWORK-5G", "Cafe", "CAFE-guest",
+	"x", "Office_5G", "office_5g_ext", "The quick brown fox jumps",
+	"Caf\xc3\xa9", "caf\xc3\xa9-guest", "\xe6\x97\xa5\xe6\x9c\xac",
+	"back\\slash", "[tab\there]",
+};
+
+static uint64_t
+bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+
+	return dhcpcd_wi_scan_compare(*(DHCPCD_WI_SCAN * const *)a,
+	    *(DHCPCD_WI_SCAN * const *)b);
+}
+
+int
+main(void)
+{
+	static DHCPCD_WPA_BSS bss[BENCH_BSS];
+	static DHCPCD_WPA_BSS_KEY keys[BENCH_BSS * 2];
+	static DHCPCD_WI_SCAN scans[BENCH_BSS], *order[BENCH_BSS];
+	DHCPCD_WPA_BSS_KEY *sorted;
+	DHCPCD_WPA_BSS *b;
+	size_t k, j, bad;
+	uint64_t tkeys, tcmp;
+
+	srandom(1);
+	for (k = 0; k < BENCH_BSS; k++) {
+		b = &bss[k];
+		b->id = (unsigned int)k;
+		b->bssid_set = true;
+		b->bssid[4] = (uint8_t)(k >> 8);
+		b->bssid[5] = (uint8_t)k;
+		b->ssid_len = (uint8_t)snprintf((char *)b->ssid,
+		    sizeof(b->ssid), "%s%ld",
+		    bench_prefixes[(size_t)random() %
+		    __arraycount(bench_prefixes)], random() % 120);
+		b->strength = (int)(random() % 101);
+		dhcpcd_wpa_bss_scan(&scans[k], b);
+	}
+
+	tkeys = tcmp = 0;
+	sorted = NULL;
+	for (k = 0; k < BENCH_SORTS; k++) {
+		tkeys -= bench_ns();
+		for (j = 0; j < BENCH_BSS; j++)
+			dhcpcd_wpa_bss_key(&keys[j], &bss[j]);
+		sorted = dhcpcd_wpa_bss_sort(keys, keys + BENCH_BSS,
+		    BENCH_BSS);
+		tkeys += bench_ns();
+
+		for (j = 0; j < BENCH_BSS; j++)
+			order[j] = &scans[j];
+		tcmp -= bench_ns();
+		qsort(order, BENCH_BSS, sizeof(*order), bench_compare);
+		tcmp += bench_ns();
+	}
+
+	bad = 0;
+	for (j = 0; j < BENCH_BSS; j++) {
+		b = sorted[j].bss;
+		if (strcmp(scans[b - bss].ssid, order[j]->ssid) != 0 ||
+		    b->strength != order[j]->strength.value)
+			bad++;
+	}
+	if (bad != 0)
+		errx(EXIT_FAILURE, "%zu BSS sorted differently", bad);
+
+	printf("%d BSS: keys %.1f us, comparator %.1f us per sort\n",
+	    BENCH_BSS, (double)tkeys / BENCH_SORTS / 1000.0,
+	    (double)tcmp / BENCH_SORTS / 1000.0);
+	return EXIT_SUCCESS;
+}
@@ -27,6 +27,9 @@
 // For strverscmp(3)
 #define _GNU_SOURCE
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -38,9 +41,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define IN_LIBDHCPCD
@@ -68,6 +73,22 @@
 #define iswhite(c)	(c == ' ' || c == '\t' || c == '\n')
 #endif
 
+#define UNUSED(x)	(void)(x)
+
+/* Bytes to read from the listen socket at once */
+#define DHCPCD_RECV_SIZE	4096
+
+/* dhcpcd_open_start sends the handshake and dhcpcd_open_dispatch
+ * reads the replies as they arrive, so opening never blocks.
+ * open_state is the reply we are waiting for and open_sent
+ * is the next command to send. */
+#define DHO_NONE		0
+#define DHO_VERSION		1
+#define DHO_CFFILE		2
+#define DHO_PRIVILEGED		3
+#define DHO_INTERFACES		4
+#define DHO_INTERFACE		5
+
 const char * const dhcpcd_cstates[DHC_MAX] = {
 	"unknown",
 	"down",
@@ -112,13 +133,11 @@ static const struct dhcpcd_vs dhcpcd_states[] = {
 };
 
 static ssize_t
-dhcpcd_command_fd(DHCPCD_CONNECTION *con,
-    int fd, bool progname, const char *cmd, char **buffer)
+dhcpcd_command_send(DHCPCD_CONNECTION *con,
+    int fd, bool progname, const char *cmd)
 {
 	size_t pl, cl, len;
-	ssize_t bytes;
 	char buf[1024], *p;
-	char *nbuf;
 
 	assert(con);
 	assert(cmd);
@@ -157,58 +176,7 @@ dhcpcd_command_fd(DHCPCD_CONNECTION *con,
 	} else
 		buf[len - 1] = '\0';
 
-	if (write(fd, buf, len) == -1)
-		return -1;
-
-	if (con->read_error) {
-		int error;
-
-		bytes = read(fd, &error, sizeof(error));
-		if (bytes != sizeof(error)) {
-			errno = EINVAL;
-			return -1;
-		}
-		con->error = error;
-		if (error != 0) {
-			errno = error;
-			return -1;
-		}
-	}
-
-	if (buffer == NULL)
-		return 0;
-
-	bytes = read(fd, buf, sizeof(size_t));
-	if (bytes == 0 || bytes == -1)
-		return bytes;
-	memcpy(&len, buf, sizeof(size_t));
-	nbuf = realloc(*buffer, len + 1);
-	if (nbuf == NULL)
-		return -1;
-	*buffer = nbuf;
-	bytes = read(fd, *buffer, len);
-	if (bytes != -1 && (size_t)bytes < len)
-		*buffer[bytes] = '\0';
-	return bytes;
-}
-
-ssize_t
-dhcpcd_command(DHCPCD_CONNECTION *con, const char *cmd, char **buffer)
-{
-
-	assert(con);
-	if (!con->privileged) {
-		errno = EACCES;
-		return -1;
-	}
-	return dhcpcd_command_fd(con, con->command_fd, true, cmd, buffer);
-}
-
-static ssize_t
-dhcpcd_ctrl_command(DHCPCD_CONNECTION *con, const char *cmd, char **buffer)
-{
-
-	return dhcpcd_command_fd(con, con->command_fd, false, cmd, buffer);
+	return write(fd, buf, len);
 }
 
 bool
@@ -228,32 +196,6 @@ dhcpcd_realloc(DHCPCD_CONNECTION *con, size_t len)
 	return true;
 }
 
-ssize_t
-dhcpcd_command_arg(DHCPCD_CONNECTION *con, const char *cmd, const char *arg,
-    char **buffer)
-{
-	size_t cmdlen, len;
-
-	assert(con);
-	assert(cmd);
-
-	cmdlen = strlen(cmd);
-	if (arg)
-		len = cmdlen + strlen(arg) + 2;
-	else
-		len = cmdlen + 1;
-	if (!dhcpcd_realloc(con, len))
-		return -1;
-	strlcpy(con->buf, cmd, con->buflen);
-	if (arg) {
-		con->buf[cmdlen] = ' ';
-		strlcpy(con->buf + cmdlen + 1, arg, con->buflen - 1 - cmdlen);
-	}
-
-	return dhcpcd_command_fd(con, con->command_fd, true, con->buf, buffer);
-}
-
-
 static int
 dhcpcd_connect(const char *path)
 {
@@ -275,27 +217,100 @@ dhcpcd_connect(const char *path)
 	return -1;
 }
 
+/* dhcpcd sends us a block of NUL separated var=value strings.
+ * We index the block with an open addressed hash table of offsets
+ * to each var so we don't have to walk the block for every lookup.
+ * Offsets are stored plus one so that zero is an empty slot.
+ * data must be NUL terminated at data[len]. */
+static uint32_t *
+env_index(const char *data, size_t len, uint32_t *mask)
+{
+	const char *p, *end, *eq, *k;
+	size_t n, size, klen;
+	uint32_t *index, h, slot;
+
+	if (len >= UINT32_MAX) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	end = data + len;
+	n = 0;
+	for (p = data; p < end; p += strlen(p) + 1) {
+		if (*p != '\0')
+			n++;
+	}
+	/* Keep the load factor under a half */
+	for (size = 8; size < n * 2; size <<= 1)
+		;
+	index = calloc(size, sizeof(*index));
+	if (index == NULL)
+		return NULL;
+	*mask = (uint32_t)(size - 1);
+
+	for (p = data; p < end; p += strlen(p) + 1) {
+		if (*p == '\0' || (eq = strchr(p, '=')) == NULL)
+			continue;
+		klen = (size_t)(eq - p);
+		h = dhcpcd_hash(DHCPCD_HASH_INIT, p, klen);
+		for (slot = h & *mask; index[slot] != 0;
+		    slot = (slot + 1) & *mask)
+		{
+			/* Like the walk, the first var wins */
+			k = data + index[slot] - 1;
+			if (strncmp(k, p, klen) == 0 && k[klen] == '=')
+				break;
+		}
+		if (index[slot] == 0)
+			index[slot] = (uint32_t)(p - data) + 1;
+	}
+	return index;
+}
+
 static const char *
-get_value(const char *data, size_t len, const char *var)
+get_value(const char *data, size_t len, const uint32_t *index, uint32_t mask,
+    const char *prefix, const char *var)
 {
-	const char *end, *p;
-	size_t vlen;
+	const char *end, *p, *k;
+	size_t plen, vlen;
+	uint32_t slot;
 
 	assert(var);
-	end = data + len;
+	if (prefix == NULL)
+		prefix = "";
+	plen = strlen(prefix);
 	vlen = strlen(var);
 	p = NULL;
-	while (data + vlen + 1 < end) {
-		/* Skip past NUL padding */
-		if (*data == '\0') {
-			data++;
-			continue;
+	if (index != NULL) {
+		slot = dhcpcd_hash(dhcpcd_hash(DHCPCD_HASH_INIT, prefix, plen),
+		    var, vlen) & mask;
+		for (; index[slot] != 0; slot = (slot + 1) & mask) {
+			k = data + index[slot] - 1;
+			if (strncmp(k, prefix, plen) == 0 &&
+			    strncmp(k + plen, var, vlen) == 0 &&
+			    k[plen + vlen] == '=')
+			{
+				p = k + plen + vlen + 1;
+				break;
+			}
 		}
-		if (strncmp(data, var, vlen) == 0 && data[vlen] == '=') {
-			p = data + vlen + 1;
-			break;
+	} else {
+		end = data + len;
+		while (data + plen + vlen + 1 < end) {
+			/* Skip past NUL padding */
+			if (*data == '\0') {
+				data++;
+				continue;
+			}
+			if (strncmp(data, prefix, plen) == 0 &&
+			    strncmp(data + plen, var, vlen) == 0 &&
+			    data[plen + vlen] == '=')
+			{
+				p = data + plen + vlen + 1;
+				break;
+			}
+			data += strlen(data) + 1;
 		}
-		data += strlen(data) + 1;
 	}
 	if (p != NULL && *p != '\0')
 		return p;
@@ -308,7 +323,8 @@ dhcpcd_get_value(const DHCPCD_IF *i, const char *var)
 
 	assert(i);
 	assert(var);
-	return get_value(i->data, i->data_len, var);
+	return get_value(i->data, i->data_len,
+	    i->data_index, i->data_index_mask, NULL, var);
 }
 
 ssize_t
@@ -485,27 +501,12 @@ dhcpcd_decode_hex(char *dst, size_t dlen, const char *src)
 const char *
 dhcpcd_get_prefix_value(const DHCPCD_IF *i, const char *prefix, const char *var)
 {
-	char pvar[128], *p;
-	size_t plen, l;
 
 	assert(i);
 	assert(prefix);
 	assert(var);
-
-	p = pvar;
-	plen = sizeof(pvar);
-	l = strlcpy(p, prefix, plen);
-	if (l >= sizeof(pvar)) {
-		errno = ENOBUFS;
-		return NULL;
-	}
-	p += l;
-	plen -= l;
-	if (strlcpy(p, var, plen) >= plen) {
-		errno = ENOBUFS;
-		return NULL;
-	}
-	return dhcpcd_get_value(i, pvar);
+	return get_value(i->data, i->data_len,
+	    i->data_index, i->data_index_mask, prefix, var);
 }
 
 static bool
@@ -578,8 +579,119 @@ dhcpcd_interfaces(DHCPCD_CONNECTION *con)
 	return con->interfaces;
 }
 
-char **
-dhcpcd_interface_names(DHCPCD_CONNECTION *con, size_t *nnames)
+struct dhcpcd_if_key {
+	const char *ifname;
+	unsigned int type;
+};
+
+static uint32_t
+dhcpcd_if_hash(const char *ifname, unsigned int type)
+{
+
+	return dhcpcd_hash(dhcpcd_hash(DHCPCD_HASH_INIT,
+	    ifname, strlen(ifname)), &type, sizeof(type));
+}
+
+static bool
+dhcpcd_if_match(const void *item, const void *key)
+{
+	const DHCPCD_IF *i;
+	const struct dhcpcd_if_key *k;
+
+	i = item;
+	k = key;
+	return i->type == k->type && strcmp(i->ifname, k->ifname) == 0;
+}
+
+static int
+dhcpcd_cmpname(const char *s1, const char *s2)
+{
+	int cmp;
+
+	if ((cmp = strcasecmp(s1, s2)) == 0)
+		cmp = strcmp(s1, s2);
+	return cmp;
+}
+
+/* Position of ifname in the sorted link vector or where it would go */
+static size_t
+dhcpcd_links_pos(DHCPCD_CONNECTION *con, const char *ifname)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = con->links_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dhcpcd_cmpname(con->links[mid]->ifname, ifname) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Add an interface to our lookup tables */
+static int
+dhcpcd_if_map(DHCPCD_CONNECTION *con, DHCPCD_IF *i)
+{
+	struct dhcpcd_if_key key;
+	uint32_t h;
+	size_t pos;
+
+	h = dhcpcd_if_hash(i->ifname, i->type);
+	if (dhcpcd_hmap_add(&con->if_map, h, i) == -1)
+		return -1;
+	if (i->type != DHT_LINK)
+		return 0;
+
+	if (con->links_len == con->links_size) {
+		DHCPCD_IF **nlinks;
+		size_t nsize;
+
+		nsize = con->links_size == 0 ? 16 : con->links_size * 2;
+		nlinks = realloc(con->links, sizeof(*nlinks) * nsize);
+		if (nlinks == NULL) {
+			key.ifname = i->ifname;
+			key.type = i->type;
+			dhcpcd_hmap_del(&con->if_map, h, dhcpcd_if_match, &key);
+			return -1;
+		}
+		con->links = nlinks;
+		con->links_size = nsize;
+	}
+	pos = dhcpcd_links_pos(con, i->ifname);
+	memmove(&con->links[pos + 1], &con->links[pos],
+	    sizeof(*con->links) * (con->links_len - pos));
+	con->links[pos] = i;
+	con->links_len++;
+	return 0;
+}
+
+static void
+dhcpcd_if_unmap(DHCPCD_CONNECTION *con, DHCPCD_IF *i)
+{
+	struct dhcpcd_if_key key;
+	size_t pos;
+
+	key.ifname = i->ifname;
+	key.type = i->type;
+	dhcpcd_hmap_del(&con->if_map, dhcpcd_if_hash(i->ifname, i->type),
+	    dhcpcd_if_match, &key);
+	if (i->type != DHT_LINK)
+		return;
+
+	pos = dhcpcd_links_pos(con, i->ifname);
+	if (pos < con->links_len && con->links[pos] == i) {
+		con->links_len--;
+		memmove(&con->links[pos], &con->links[pos + 1],
+		    sizeof(*con->links) * (con->links_len - pos));
+	}
+}
+
+/* Each name is allocated so the result can be freed with dhcpcd_freev */
+static char **
+dhcpcd_interface_names1(DHCPCD_CONNECTION *con, bool sorted, size_t *nnames)
 {
 	char **names;
 	size_t n;
@@ -589,32 +701,44 @@ dhcpcd_interface_names(DHCPCD_CONNECTION *con, size_t *nnames)
 	if (con->interfaces == NULL)
 		return NULL;
 
-	n = 0;
-	for (i = con->interfaces; i; i = i->next) {
-		 if (i->type == DHT_LINK)
-			n++;
-	}
-	names = malloc(sizeof(char *) * (n + 1));
+	names = malloc(sizeof(char *) * (con->links_len + 1));
 	if (names == NULL)
 		return NULL;
+
 	n = 0;
-	for (i = con->interfaces; i; i = i->next) {
-		if (i->type == DHT_LINK) {
-			names[n] = strdup(i->ifname);
-			if (names[n] == NULL) {
-				dhcpcd_freev(names);
-				return NULL;
-			}
-			n++;
+	names[n] = NULL;
+	i = sorted ? NULL : con->interfaces;
+	for (;;) {
+		if (sorted) {
+			if (n == con->links_len)
+				break;
+			i = con->links[n];
+		} else {
+			for (; i && i->type != DHT_LINK; i = i->next)
+				;
+			if (i == NULL)
+				break;
+		}
+		if ((names[n] = strdup(i->ifname)) == NULL) {
+			dhcpcd_freev(names);
+			return NULL;
 		}
+		names[++n] = NULL;
+		if (!sorted)
+			i = i->next;
 	}
-	names[n] = NULL;
 	if (nnames)
 		*nnames = n;
-
 	return names;
 }
 
+char **
+dhcpcd_interface_names(DHCPCD_CONNECTION *con, size_t *nnames)
+{
+
+	return dhcpcd_interface_names1(con, false, nnames);
+}
+
 void
 dhcpcd_freev(char **argv)
 {
@@ -627,44 +751,26 @@ dhcpcd_freev(char **argv)
 	}
 }
 
-static int
-dhcpcd_cmpstring(const void *p1, const void *p2)
-{
-	const char *s1, *s2;
-	int cmp;
-
-	s1 = *(char * const *)p1;
-	s2 = *(char * const *)p2;
-	if ((cmp = strcasecmp(s1, s2)) == 0)
-		cmp = strcmp(s1, s2);
-	return cmp;
-}
-
 char **
 dhcpcd_interface_names_sorted(DHCPCD_CONNECTION *con)
 {
-	char **names;
-	size_t nnames;
 
-	names = dhcpcd_interface_names(con, &nnames);
-	if (names)
-		qsort(names, nnames, sizeof(char *), dhcpcd_cmpstring);
-	return names;
+	return dhcpcd_interface_names1(con, true, NULL);
 }
 
 DHCPCD_IF *
 dhcpcd_get_if(DHCPCD_CONNECTION *con, const char *ifname, unsigned int type)
 {
-	DHCPCD_IF *i;
+	struct dhcpcd_if_key key;
 
 	assert(con);
 	assert(ifname);
 	assert(type);
 
-	for (i = con->interfaces; i; i = i->next)
-		if (i->type == type && strcmp(i->ifname, ifname) == 0)
-			return i;
-	return NULL;
+	key.ifname = ifname;
+	key.type = type;
+	return dhcpcd_hmap_find(&con->if_map, dhcpcd_if_hash(ifname, type),
+	    dhcpcd_if_match, &key);
 }
 
 static unsigned int
@@ -732,51 +838,264 @@ dhcpcd_reason_to_statetype(const char *reason,
 		*type = DHT_IPV4;
 }
 
-static DHCPCD_IF *
-dhcpcd_new_if(DHCPCD_CONNECTION *con, char *data, size_t len)
+/* Monotonic time in milliseconds */
+uint64_t
+dhcpcd_now(void)
 {
-	const char *ifname, *ifclass, *reason, *order, *flags;
-	unsigned int state, type;
-	char *orderdup, *o, *p;
-	DHCPCD_IF *e, *i, *l, *n, *nl;
-	bool addedi;
+	struct timespec ts;
 
-#if 0
-	char *dp = data, *de = data + len;
-	while (dp < de) {
-		printf ("XX: %s\n", dp);
-		dp += strlen(dp) + 1;
-	}
-#endif
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-	ifname = get_value(data, len, "interface");
-	if (ifname == NULL || *ifname == '\0') {
-		errno = ESRCH;
-		return NULL;
-	}
+static void
+dhcpcd_damp_add(DHCPCD_CONNECTION *con, DHCPCD_IF *i, uint64_t now)
+{
 
-	reason = get_value(data, len, "reason");
-	if (reason == NULL || *reason == '\0') {
-		errno = ESRCH;
-		return NULL;
-	}
-	dhcpcd_reason_to_statetype(reason, &state, &type);
+	i->damp_until = now + con->damping;
+	i->damp_next = NULL;
+	i->damp_prev = con->damp_tail;
+	*con->damp_tail = i;
+	con->damp_tail = &i->damp_next;
+}
 
-	ifclass = get_value(data, len, "ifclass");
-	/* Skip pseudo interfaces */
-	if (ifclass && *ifclass != '\0') {
-		errno = ENOTSUP;
-		return NULL;
+static void
+dhcpcd_damp_del(DHCPCD_CONNECTION *con, DHCPCD_IF *i)
+{
+
+	if (i->damp_prev == NULL)
+		return;
+	if (i->damp_next != NULL)
+		i->damp_next->damp_prev = i->damp_prev;
+	else
+		con->damp_tail = i->damp_prev;
+	*i->damp_prev = i->damp_next;
+	i->damp_prev = NULL;
+	i->damp_pending = false;
+}
+
+static void
+dhcpcd_if_free(DHCPCD_IF *i)
+{
+
+	dhcpcd_damp_del(i->con, i);
+	dhcpcd_if_unmap(i->con, i);
+	free(i->data);
+	free(i->data_index);
+	free(i->last_message);
+	free(i);
+}
+
+static bool
+dhcpcd_order_match(const void *item, const void *key)
+{
+
+	return strcmp(*(const char * const *)item, key) == 0;
+}
+
+static void
+dhcpcd_order_free(DHCPCD_CONNECTION *con)
+{
+
+	free(con->order);
+	con->order = NULL;
+	con->order_len = 0;
+	free(con->order_names);
+	con->order_names = NULL;
+	con->order_nnames = 0;
+	dhcpcd_hmap_clear(&con->order_map);
+}
+
+/* Remember interface_order and map each name in it to its rank.
+ * Returns 1 if the order changed, 0 if not or -1 on error. */
+static int
+dhcpcd_order_set(DHCPCD_CONNECTION *con, const char *order)
+{
+	size_t len, n;
+	char *o, *p, *t;
+	uint32_t h;
+
+	len = strlen(order);
+	if (con->order != NULL && con->order_len == len &&
+	    memcmp(con->order, order, len) == 0)
+		return 0;
+
+	dhcpcd_order_free(con);
+
+	/* The order as given followed by a copy split into names */
+	o = malloc((len + 1) * 2);
+	if (o == NULL)
+		return -1;
+	memcpy(o, order, len + 1);
+	p = o + len + 1;
+	memcpy(p, order, len + 1);
+	n = 1;
+	for (t = p; *t != '\0'; t++) {
+		if (*t == ' ')
+			n++;
 	}
-	if (state == DHS_RECONFIGURE || state == DHS_INFORM) {
-		errno = ENOTSUP;
-		return NULL;
+	con->order_names = malloc(sizeof(*con->order_names) * n);
+	if (con->order_names == NULL) {
+		free(o);
+		return -1;
 	}
+	con->order = o;
+	con->order_len = len;
 
-	order = get_value(data, len, "interface_order");
-	if (order == NULL || *order == '\0') {
-		errno = ESRCH;
-		return NULL;
+	n = 0;
+	while ((t = strsep(&p, " ")) != NULL) {
+		if (*t == '\0')
+			continue;
+		h = dhcpcd_hash(DHCPCD_HASH_INIT, t, strlen(t));
+		if (dhcpcd_hmap_find(&con->order_map, h,
+		    dhcpcd_order_match, t) != NULL)
+			continue;
+		con->order_names[n] = t;
+		if (dhcpcd_hmap_add(&con->order_map, h,
+		    &con->order_names[n]) == -1)
+		{
+			dhcpcd_order_free(con);
+			return -1;
+		}
+		n++;
+	}
+	con->order_nnames = n;
+	return 1;
+}
+
+static bool
+dhcpcd_order_rank(DHCPCD_CONNECTION *con, DHCPCD_IF *i)
+{
+	const char **name;
+
+	name = dhcpcd_hmap_find(&con->order_map,
+	    dhcpcd_hash(DHCPCD_HASH_INIT, i->ifname, strlen(i->ifname)),
+	    dhcpcd_order_match, i->ifname);
+	if (name == NULL)
+		return false;
+	i->order_rank = (size_t)(name - con->order_names);
+	return true;
+}
+
+/* The caller owns the data of the interface being added. */
+static void
+dhcpcd_order_drop(DHCPCD_IF *e, DHCPCD_IF *i)
+{
+
+	if (e == i) {
+		dhcpcd_damp_del(i->con, i);
+		dhcpcd_if_unmap(i->con, i);
+		free(i->last_message);
+		free(i);
+	} else
+		dhcpcd_if_free(e);
+}
+
+/* The order has changed, so rank all interfaces and place them
+ * into buckets by rank and type.
+ * Interfaces no longer in the order are freed.
+ * Returns 1 if i is still present, 0 if not or -1 on error. */
+static int
+dhcpcd_order_sort(DHCPCD_CONNECTION *con, DHCPCD_IF *i)
+{
+	DHCPCD_IF **slots, *e, *n, *l;
+	size_t nslots, slot;
+	int r;
+
+	nslots = con->order_nnames * DHT_MAX;
+	slots = calloc(nslots == 0 ? 1 : nslots, sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+
+	r = 0;
+	for (e = con->interfaces; e; e = n) {
+		n = e->next;
+		if (dhcpcd_order_rank(con, e)) {
+			slot = e->order_rank * DHT_MAX + e->type;
+			if (slots[slot] == NULL) {
+				slots[slot] = e;
+				if (e == i)
+					r = 1;
+				continue;
+			}
+		}
+		dhcpcd_order_drop(e, i);
+	}
+
+	l = con->interfaces = NULL;
+	for (slot = 0; slot < nslots; slot++) {
+		if ((e = slots[slot]) == NULL)
+			continue;
+		e->next = NULL;
+		if (l == NULL)
+			con->interfaces = e;
+		else
+			l->next = e;
+		l = e;
+	}
+	free(slots);
+	return r;
+}
+
+static void
+dhcpcd_if_invalidate(DHCPCD_CONNECTION *con, const char *ifname)
+{
+	DHCPCD_IF *i;
+	unsigned int type;
+
+	for (type = DHT_LINK; type < DHT_MAX; type++) {
+		if ((i = dhcpcd_get_if(con, ifname, type)) != NULL)
+			i->message_valid = false;
+	}
+}
+
+static DHCPCD_IF *
+dhcpcd_new_if(DHCPCD_CONNECTION *con, char *data, size_t len,
+    uint32_t *index, uint32_t mask)
+{
+	const char *ifname, *ifclass, *reason, *order, *flags;
+	unsigned int state, type;
+	int order_changed, r;
+	DHCPCD_IF *e, *i, *l, *n;
+	bool newi;
+
+#if 0
+	char *dp = data, *de = data + len;
+	while (dp < de) {
+		printf ("XX: %s\n", dp);
+		dp += strlen(dp) + 1;
+	}
+#endif
+
+	ifname = get_value(data, len, index, mask, NULL, "interface");
+	if (ifname == NULL || *ifname == '\0') {
+		errno = ESRCH;
+		return NULL;
+	}
+
+	reason = get_value(data, len, index, mask, NULL, "reason");
+	if (reason == NULL || *reason == '\0') {
+		errno = ESRCH;
+		return NULL;
+	}
+	dhcpcd_reason_to_statetype(reason, &state, &type);
+
+	ifclass = get_value(data, len, index, mask, NULL, "ifclass");
+	/* Skip pseudo interfaces */
+	if (ifclass && *ifclass != '\0') {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if (state == DHS_RECONFIGURE || state == DHS_INFORM) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	order = get_value(data, len, index, mask, NULL, "interface_order");
+	if (order == NULL || *order == '\0') {
+		errno = ESRCH;
+		return NULL;
 	}
 
 	i = NULL;
@@ -795,7 +1114,7 @@ dhcpcd_new_if(DHCPCD_CONNECTION *con, char *data, size_t len)
                                                 l->next = e->next;
                                         else
                                                 con->interfaces = e->next;
-                                        free(e);
+                                        dhcpcd_if_free(e);
                                 }
                         } else
                                 l = e;
@@ -807,40 +1126,37 @@ dhcpcd_new_if(DHCPCD_CONNECTION *con, char *data, size_t len)
 			return NULL;
 	}
 
-	orderdup = strdup(order);
-	if (orderdup == NULL)
+	order_changed = dhcpcd_order_set(con, order);
+	if (order_changed == -1)
 		return NULL;
 
 	/* Find our pointer */
-        if (i == NULL) {
-                l = NULL;
-                for (e = con->interfaces; e; e = e->next) {
-                        if (e->type == type && strcmp(e->ifname, ifname) == 0) {
-                                i = e;
-                                break;
-                        }
-                        l = e;
-                }
-        }
-	if (i == NULL) {
+	if (i == NULL)
+		i = dhcpcd_get_if(con, ifname, type);
+	newi = i == NULL;
+	if (newi) {
 		i = malloc(sizeof(*i));
-		if (i == NULL) {
-			free(orderdup);
-			return NULL;
-		}
-		if (l)
-			l->next = i;
-		else
-			con->interfaces = i;
-		i->next = NULL;
+		if (i == NULL)
+			goto order_fail;
+		/* Put it at the head, the sort below will move it */
+		i->next = con->interfaces;
+		con->interfaces = i;
 		i->last_message = NULL;
-	} else
+		i->message_new = false;
+		i->damp_prev = NULL;
+		i->damp_pending = false;
+		i->damped = 0;
+	} else {
 		free(i->data);
+		free(i->data_index);
+	}
 
 	/* Now fill out our interface structure */
 	i->con = con;
 	i->data = data;
 	i->data_len = len;
+	i->data_index = index;
+	i->data_index_mask = mask;
 	i->ifname = ifname;
 	i->type = type;
 	i->state = state;
@@ -860,130 +1176,676 @@ dhcpcd_new_if(DHCPCD_CONNECTION *con, char *data, size_t len)
 	if (i->ssid == NULL && i->wireless)
 		i->ssid = dhcpcd_get_value(i, i->up ? "new_ssid" : "old_ssid");
 
+	/* Our message depends on our siblings being up */
+	i->message_valid = false;
+	dhcpcd_if_invalidate(con, ifname);
+
 	/* Work out if we're waiting for any other addresses */
 	if (dhcpcd_get_value(i, "af_waiting") == NULL)
 		con->af_waiting = false;
 	else
 		con->af_waiting = true;
 
-       /* Sort! */
-	n = nl = NULL;
-	p = orderdup;
-	addedi = false;
-        while ((o = strsep(&p, " ")) != NULL) {
-                for (type = 0; type < DHT_MAX; type++) {
-                        l = NULL;
-                        for (e = con->interfaces; e; e = e->next) {
-                                if (e->type == type && strcmp(e->ifname, o) == 0)
-                                        break;
-                                l = e;
-                        }
-                        if (e == NULL)
-                                continue;
-			if (i == e)
-				addedi = true;
-                        if (l)
-                                l->next = e->next;
-                        else
-                                con->interfaces = e->next;
-                        e->next = NULL;
-                        if (nl == NULL)
-                                n = nl = e;
-                        else {
-                                nl->next = e;
-                                nl = e;
-                        }
-                }
-        }
-	free(orderdup);
-        /* Free any stragglers */
-        while (con->interfaces) {
-                e = con->interfaces->next;
-		free(con->interfaces->data);
-		free(con->interfaces->last_message);
-                free(con->interfaces);
-                con->interfaces = e;
-        }
-        con->interfaces = n;
+	if (newi && dhcpcd_if_map(con, i) == -1) {
+		con->interfaces = i->next;
+		free(i);
+		goto order_fail;
+	}
+
+	/* Sort! */
+	if (order_changed) {
+		r = dhcpcd_order_sort(con, i);
+		if (r == -1) {
+			/* Leave the order as is and try again next time */
+			dhcpcd_order_free(con);
+			return i;
+		}
+		return r == 1 ? i : NULL;
+	}
+
+	/* Order is unchanged, so only a new interface needs placing */
+	if (!newi)
+		return i;
+	con->interfaces = i->next;
+	if (!dhcpcd_order_rank(con, i)) {
+		dhcpcd_order_drop(i, i);
+		return NULL;
+	}
+	l = NULL;
+	for (e = con->interfaces; e; e = e->next) {
+		if (e->order_rank > i->order_rank ||
+		    (e->order_rank == i->order_rank && e->type > i->type))
+			break;
+		l = e;
+	}
+	i->next = e;
+	if (l == NULL)
+		con->interfaces = i;
+	else
+		l->next = i;
+	return i;
 
-	return addedi ? i : NULL;
+order_fail:
+	/* The list wasn't sorted to the new order, so forget it
+	 * and sort next time */
+	if (order_changed)
+		dhcpcd_order_free(con);
+	return NULL;
 }
 
+/* Takes ownership of data which must be NUL terminated at data[len] */
 static DHCPCD_IF *
-dhcpcd_read_if(DHCPCD_CONNECTION *con, int fd)
+dhcpcd_add_if(DHCPCD_CONNECTION *con, char *data, size_t len)
 {
-	char *rbuf, *rbufp;
-	size_t len;
-	ssize_t bytes;
+	uint32_t *index, mask;
 	DHCPCD_IF *i;
 
-	bytes = read(fd, &len, sizeof(len));
-	if (bytes == 0 || bytes == -1) {
-		dhcpcd_close(con);
-		return NULL;
+	/* If we can't index the block, lookups just walk it */
+	mask = 0;
+	index = env_index(data, len, &mask);
+	i = dhcpcd_new_if(con, data, len, index, mask);
+	if (i == NULL) {
+		free(data);
+		free(index);
 	}
-	if (bytes != sizeof(len)) {
-		errno = EINVAL;
-		return NULL;
+	return i;
+}
+
+/* A flapping interface can send many events in a short time.
+ * The first event is delivered and a window opened.
+ * Events during the window are held back, each superseding the last,
+ * and the latest is delivered when the window closes. */
+static bool
+dhcpcd_damp(DHCPCD_IF *i)
+{
+	DHCPCD_CONNECTION *con;
+
+	con = i->con;
+	if (i->damp_prev != NULL) {
+		if (i->damp_pending) {
+			i->damped++;
+			con->damped++;
+		}
+		i->damp_pending = true;
+		return false;
+	}
+	if (con->damping != 0)
+		dhcpcd_damp_add(con, i, dhcpcd_now());
+	return true;
+}
+
+static void
+dhcpcd_dispatchif(DHCPCD_IF *i)
+{
+
+	assert(i);
+	if (dhcpcd_damp(i) && i->con->if_cb)
+		i->con->if_cb(i, i->con->if_context);
+	dhcpcd_wpa_if_event(i);
+}
+
+/* Read what we can from fd into the receive buffer,
+ * up to need bytes in total. */
+static ssize_t
+dhcpcd_recv_fd(DHCPCD_RBUF *rb, int fd, size_t need)
+{
+	ssize_t bytes;
+	char *nbuf;
+
+	if (rb->size < need) {
+		nbuf = realloc(rb->buf, need);
+		if (nbuf == NULL)
+			return -1;
+		rb->buf = nbuf;
+		rb->size = need;
+	}
+
+	bytes = read(fd, rb->buf + rb->len, need - rb->len);
+	if (bytes > 0)
+		rb->len += (size_t)bytes;
+	return bytes;
+}
+
+/* Move any partial frame to the front */
+static void
+dhcpcd_recv_compact(DHCPCD_RBUF *rb)
+{
+
+	if (rb->pos == rb->len)
+		rb->len = 0;
+	else if (rb->pos != 0) {
+		rb->len -= rb->pos;
+		memmove(rb->buf, rb->buf + rb->pos, rb->len);
 	}
-	if (len >= SSIZE_MAX) {
-		/* Even this is probably too big! */
+	rb->pos = 0;
+}
+
+/* Read what we can from the listen socket without blocking.
+ * Frames are a size_t length followed by the data and may arrive
+ * over many reads, so we buffer them until complete. */
+static ssize_t
+dhcpcd_recv(DHCPCD_CONNECTION *con)
+{
+	size_t need, len;
+
+	need = con->recv.len + DHCPCD_RECV_SIZE;
+	/* Make room for the whole frame if we know the size */
+	if (con->recv.len - con->recv.pos >= sizeof(len)) {
+		memcpy(&len, con->recv.buf + con->recv.pos, sizeof(len));
+		if (len >= SSIZE_MAX - sizeof(len)) {
+			/* Even this is probably too big! */
+			errno = ENOBUFS;
+			return -1;
+		}
+		if (need < con->recv.pos + sizeof(len) + len)
+			need = con->recv.pos + sizeof(len) + len;
+	}
+	return dhcpcd_recv_fd(&con->recv, con->listen_fd, need);
+}
+
+/* dhcpcd-10.5.0 acknowledges --listen with an error code.
+ * Returns 1 if it was taken, 0 if we need more data. */
+static int
+dhcpcd_recv_ack(DHCPCD_CONNECTION *con)
+{
+	int error;
+
+	if (con->recv.len - con->recv.pos < sizeof(error))
+		return 0;
+	memcpy(&error, con->recv.buf + con->recv.pos, sizeof(error));
+	con->recv.pos += sizeof(error);
+	con->listen_ack = false;
+	con->error = error;
+	return 1;
+}
+
+/* Returns 1 if a frame was taken, 0 if we need more data
+ * or -1 on error. */
+static int
+dhcpcd_recv_if(DHCPCD_CONNECTION *con, DHCPCD_RBUF *rb, DHCPCD_IF **i)
+{
+	size_t len;
+	char *data;
+
+	*i = NULL;
+	if (rb->len - rb->pos < sizeof(len))
+		return 0;
+	memcpy(&len, rb->buf + rb->pos, sizeof(len));
+	if (len >= SSIZE_MAX - sizeof(len)) {
 		errno = ENOBUFS;
-		return NULL;
+		return -1;
 	}
-	rbuf = malloc(len + 1);
-	if (rbuf == NULL)
-		return NULL;
-	rbufp = rbuf;
-again:
-	bytes = read(fd, rbufp, len);
-	if (bytes == 0 || bytes == -1) {
-		free(rbuf);
+	if (rb->len - rb->pos - sizeof(len) < len)
+		return 0;
+
+	data = malloc(len + 1);
+	if (data == NULL)
+		return -1;
+	memcpy(data, rb->buf + rb->pos + sizeof(len), len);
+	data[len] = '\0';
+	rb->pos += sizeof(len) + len;
+	*i = dhcpcd_add_if(con, data, len);
+	return 1;
+}
+
+static void
+dhcpcd_recv_free(DHCPCD_RBUF *rb)
+{
+
+	free(rb->buf);
+	rb->buf = NULL;
+	rb->size = rb->len = rb->pos = 0;
+}
+
+static void
+dhcpcd_dispatch1(DHCPCD_CONNECTION *con, bool all)
+{
+	DHCPCD_IF *i;
+	ssize_t bytes;
+	int r;
+
+	assert(con);
+	do {
+		bytes = dhcpcd_recv(con);
+		if (bytes == 0 ||
+		    (bytes == -1 && errno != EAGAIN && errno != EINTR))
+		{
+			dhcpcd_close(con);
+			return;
+		}
+
+		if (con->listen_ack) {
+			if (dhcpcd_recv_ack(con) == 0)
+				continue;
+			if (con->error != 0) {
+				update_status(con, DHC_OPENED);
+				return;
+			}
+		}
+
+		while ((r = dhcpcd_recv_if(con, &con->recv, &i)) == 1) {
+			if (i)
+				dhcpcd_dispatchif(i);
+
+			/* Have to call update_status last as it could
+			 * cause the interface to be destroyed. */
+			if (!all)
+				update_status(con, DHC_UNKNOWN);
+
+			/* A callback may have closed us */
+			if (con->recv.buf == NULL)
+				return;
+		}
+		if (r == -1) {
+			dhcpcd_close(con);
+			return;
+		}
+
+		dhcpcd_recv_compact(&con->recv);
+	} while (all && bytes > 0);
+
+	if (all)
+		update_status(con, DHC_UNKNOWN);
+}
+
+void
+dhcpcd_dispatch(DHCPCD_CONNECTION *con)
+{
+
+	dhcpcd_dispatch1(con, false);
+}
+
+/* Read until the socket would block, notifying each interface
+ * but only working out the connection status once at the end. */
+void
+dhcpcd_dispatch_all(DHCPCD_CONNECTION *con)
+{
+
+	dhcpcd_dispatch1(con, true);
+}
+
+/* Commands are queued on the command socket and dhcpcd replies to them
+ * in order, so each reply completes the command at the head. */
+static void
+dhcpcd_command_done(DHCPCD_CONNECTION *con, int error,
+    const char *data, size_t len)
+{
+	DHCPCD_CMD *c;
+	DHCPCD_COMMAND_STATS *st;
+	uint64_t ms;
+
+	c = con->cmd_head;
+	con->cmd_head = c->next;
+	if (con->cmd_head == NULL)
+		con->cmd_tail = &con->cmd_head;
+
+	st = &con->cmd_stats;
+	st->pending--;
+	st->completed++;
+	ms = dhcpcd_now() - c->sent;
+	st->latency = ms > UINT_MAX ? UINT_MAX : (unsigned int)ms;
+	if (st->latency > st->latency_max)
+		st->latency_max = st->latency;
+	st->latency_total += ms;
+
+	if (c->cb)
+		c->cb(con, error, data, len, c->cb_context);
+	free(c);
+}
+
+/* dhcpcd sends nothing back for some commands, so complete them
+ * once they reach the head of the queue. */
+static void
+dhcpcd_command_done_empty(DHCPCD_CONNECTION *con)
+{
+
+	while (con->cmd_head != NULL &&
+	    !con->cmd_head->error && !con->cmd_head->reply)
+		dhcpcd_command_done(con, 0, NULL, 0);
+}
+
+/* Take the reply for the command at the head of the queue.
+ * Returns 1 if taken, 0 if we need more data or -1 on error. */
+static int
+dhcpcd_command_reply(DHCPCD_CONNECTION *con)
+{
+	DHCPCD_RBUF *rb;
+	DHCPCD_CMD *c;
+	size_t need, len;
+	int error;
+
+	rb = &con->cmd_recv;
+	c = con->cmd_head;
+	need = c->error ? sizeof(error) : 0;
+	if (rb->len - rb->pos < need)
+		return 0;
+	if (c->error) {
+		memcpy(&error, rb->buf + rb->pos, sizeof(error));
+		con->error = error;
+		if (error != 0 || !c->reply) {
+			/* No data follows */
+			rb->pos += sizeof(error);
+			dhcpcd_command_done(con, error, NULL, 0);
+			return 1;
+		}
+	}
+	if (rb->len - rb->pos - need < sizeof(len))
+		return 0;
+	memcpy(&len, rb->buf + rb->pos + need, sizeof(len));
+	if (len >= SSIZE_MAX - sizeof(len) - need) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (rb->len - rb->pos - need - sizeof(len) < len)
+		return 0;
+	rb->pos += need + sizeof(len) + len;
+	dhcpcd_command_done(con, 0, rb->buf + rb->pos - len, len);
+	return 1;
+}
+
+static void
+dhcpcd_command_flush(DHCPCD_CONNECTION *con)
+{
+
+	while (con->cmd_head != NULL)
+		dhcpcd_command_done(con, ECONNRESET, NULL, 0);
+}
+
+/* Queue cmd with an optional arg and call cb with the reply.
+ * If reply is false dhcpcd only sends back an error code, if anything.
+ * When it sends nothing and nothing is ahead of us, cb is called
+ * before we return as no reply will come to dispatch it. */
+int
+dhcpcd_command_async(DHCPCD_CONNECTION *con, const char *cmd, const char *arg,
+    bool reply,
+    void (*cb)(DHCPCD_CONNECTION *, int, const char *, size_t, void *),
+    void *context)
+{
+	size_t cmdlen, len;
+	DHCPCD_CMD *c;
+	DHCPCD_COMMAND_STATS *st;
+
+	assert(con);
+	assert(cmd);
+	if (!con->open || con->open_state != DHO_NONE) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	cmdlen = strlen(cmd);
+	if (arg)
+		len = cmdlen + strlen(arg) + 2;
+	else
+		len = cmdlen + 1;
+	if (!dhcpcd_realloc(con, len))
+		return -1;
+	strlcpy(con->buf, cmd, con->buflen);
+	if (arg) {
+		con->buf[cmdlen] = ' ';
+		strlcpy(con->buf + cmdlen + 1, arg, con->buflen - 1 - cmdlen);
+	}
+
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		return -1;
+	if (dhcpcd_command_send(con, con->command_fd, true, con->buf) == -1) {
+		free(c);
+		return -1;
+	}
+	c->next = NULL;
+	c->error = con->read_error;
+	c->reply = reply;
+	c->sent = dhcpcd_now();
+	c->cb = cb;
+	c->cb_context = context;
+	if (con->cmd_tail == NULL)
+		con->cmd_tail = &con->cmd_head;
+	*con->cmd_tail = c;
+	con->cmd_tail = &c->next;
+
+	st = &con->cmd_stats;
+	st->pending++;
+	if (st->pending > st->pending_max)
+		st->pending_max = st->pending;
+
+	dhcpcd_command_done_empty(con);
+	return 0;
+}
+
+int
+dhcpcd_get_command_fd(DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	return con->command_fd;
+}
+
+/* Call when the command socket is readable. */
+void
+dhcpcd_command_dispatch(DHCPCD_CONNECTION *con)
+{
+	ssize_t bytes;
+	int r;
+
+	assert(con);
+	if (con->open_state != DHO_NONE)
+		return;
+	bytes = dhcpcd_recv_fd(&con->cmd_recv, con->command_fd,
+	    con->cmd_recv.len + DHCPCD_RECV_SIZE);
+	if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	/* Replies we did not ask for are a protocol error */
+	if (bytes == 0 || bytes == -1 || con->cmd_head == NULL) {
 		dhcpcd_close(con);
-		return NULL;
+		return;
 	}
-	if ((size_t)bytes < len) {
-		rbufp += bytes;
-		len -= (size_t)bytes;
-		goto again;
+
+	while (con->cmd_head != NULL) {
+		r = dhcpcd_command_reply(con);
+		/* A callback may have closed us */
+		if (con->command_fd == -1)
+			return;
+		if (r == -1) {
+			dhcpcd_close(con);
+			return;
+		}
+		if (r == 0)
+			break;
+		dhcpcd_command_done_empty(con);
+		if (con->command_fd == -1)
+			return;
 	}
-	if ((size_t)bytes != len) {
-		free(rbuf);
-		errno = EINVAL;
-		return NULL;
+	dhcpcd_recv_compact(&con->cmd_recv);
+}
+
+size_t
+dhcpcd_command_pending(const DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	return con->cmd_stats.pending;
+}
+
+const DHCPCD_COMMAND_STATS *
+dhcpcd_command_stats(const DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	return &con->cmd_stats;
+}
+
+struct dhcpcd_command_wait {
+	bool done;
+	int error;
+	char **buffer;
+	ssize_t bytes;
+};
+
+static void
+dhcpcd_command_wait_cb(DHCPCD_CONNECTION *con, int error,
+    const char *data, size_t len, void *arg)
+{
+	struct dhcpcd_command_wait *w = arg;
+	char *nbuf;
+
+	UNUSED(con);
+	w->done = true;
+	w->error = error;
+	if (error != 0 || w->buffer == NULL)
+		return;
+	nbuf = realloc(*w->buffer, len + 1);
+	if (nbuf == NULL) {
+		w->error = errno;
+		return;
+	}
+	memcpy(nbuf, data, len);
+	nbuf[len] = '\0';
+	*w->buffer = nbuf;
+	w->bytes = (ssize_t)len;
+}
+
+/* Queue the command and dispatch the command socket until it completes */
+static ssize_t
+dhcpcd_command_wait(DHCPCD_CONNECTION *con, const char *cmd, const char *arg,
+    char **buffer)
+{
+	struct dhcpcd_command_wait w = { false, 0, buffer, 0 };
+	struct pollfd pfd;
+
+	if (dhcpcd_command_async(con, cmd, arg, buffer != NULL,
+	    dhcpcd_command_wait_cb, &w) == -1)
+		return -1;
+	pfd.fd = con->command_fd;
+	pfd.events = POLLIN;
+	while (!w.done) {
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			w.error = errno;
+			dhcpcd_close(con);
+			break;
+		}
+		dhcpcd_command_dispatch(con);
+	}
+	if (w.error != 0) {
+		errno = w.error;
+		return -1;
+	}
+	return w.bytes;
+}
+
+ssize_t
+dhcpcd_command(DHCPCD_CONNECTION *con, const char *cmd, char **buffer)
+{
+
+	assert(con);
+	if (!con->privileged) {
+		errno = EACCES;
+		return -1;
 	}
-	rbufp[bytes] = '\0';
+	return dhcpcd_command_wait(con, cmd, NULL, buffer);
+}
+
+ssize_t
+dhcpcd_command_arg(DHCPCD_CONNECTION *con, const char *cmd, const char *arg,
+    char **buffer)
+{
+
+	return dhcpcd_command_wait(con, cmd, arg, buffer);
+}
+
+void
+dhcpcd_set_damping(DHCPCD_CONNECTION *con, unsigned int msec)
+{
+
+	assert(con);
+	con->damping = msec;
+}
+
+unsigned int
+dhcpcd_damping(const DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	return con->damping;
+}
 
-	i = dhcpcd_new_if(con, rbuf, (size_t)((rbufp - rbuf) + bytes));
-	if (i == NULL)
-		free(rbuf);
-	return i;
+size_t
+dhcpcd_damped(const DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	return con->damped;
 }
 
-static void
-dhcpcd_dispatchif(DHCPCD_IF *i)
+size_t
+dhcpcd_if_damped(const DHCPCD_IF *i)
 {
 
 	assert(i);
-	if (i->con->if_cb)
-		i->con->if_cb(i, i->con->if_context);
-	dhcpcd_wpa_if_event(i);
+	return i->damped;
+}
+
+/* Milliseconds until dhcpcd_dispatch_timeout should be called
+ * or -1 if there is nothing to wait for.
+ * This covers commands to wpa_supplicant as well as damping. */
+int
+dhcpcd_get_timeout(DHCPCD_CONNECTION *con)
+{
+	uint64_t now;
+	DHCPCD_WPA *wpa;
+	int ms, wms;
+
+	assert(con);
+	if (con->damp_head == NULL)
+		ms = -1;
+	else {
+		now = dhcpcd_now();
+		if (con->damp_head->damp_until <= now)
+			ms = 0;
+		else if (con->damp_head->damp_until - now > INT_MAX)
+			ms = INT_MAX;
+		else
+			ms = (int)(con->damp_head->damp_until - now);
+	}
+	for (wpa = con->wpa; wpa; wpa = wpa->next) {
+		wms = dhcpcd_wpa_get_timeout(wpa);
+		if (wms != -1 && (ms == -1 || wms < ms))
+			ms = wms;
+	}
+	return ms;
 }
 
 void
-dhcpcd_dispatch(DHCPCD_CONNECTION *con)
+dhcpcd_dispatch_timeout(DHCPCD_CONNECTION *con)
 {
 	DHCPCD_IF *i;
+	DHCPCD_WPA *wpa;
+	uint64_t now;
+	bool pending;
 
 	assert(con);
-	i = dhcpcd_read_if(con, con->listen_fd);
-
-	if (i)
-		dhcpcd_dispatchif(i);
+	now = dhcpcd_now();
+	/* All windows are the same length so the list is in order */
+	while ((i = con->damp_head) != NULL && i->damp_until <= now) {
+		pending = i->damp_pending;
+		dhcpcd_damp_del(con, i);
+		if (!pending)
+			continue;
+		/* Keep damping while it flaps */
+		if (con->damping != 0)
+			dhcpcd_damp_add(con, i, now);
+		if (con->if_cb) {
+			con->if_cb(i, con->if_context);
+			/* The callback may have closed us */
+			if (con->listen_fd == -1)
+				return;
+		}
+	}
 
-	/* Have to call update_status last as it could
-	 * cause the interface to be destroyed. */
-	update_status(con, DHC_UNKNOWN);
+	for (wpa = con->wpa; wpa; wpa = wpa->next) {
+		dhcpcd_wpa_dispatch_timeout(wpa);
+		if (con->listen_fd == -1)
+			return;
+	}
 }
 
 DHCPCD_CONNECTION *
@@ -993,9 +1855,13 @@ dhcpcd_new(void)
 
 	con = calloc(1, sizeof(*con));
 	con->command_fd = con->listen_fd = -1;
+	con->wait_fd = -1;
+	con->wpa_dir_fd = con->wpa_dir_wd = -1;
 	con->open = false;
 	con->progname = "libdhcpcd";
 	con->af_waiting = false;
+	con->damp_tail = &con->damp_head;
+	con->cmd_tail = &con->cmd_head;
 	return con;
 }
 
@@ -1040,24 +1906,229 @@ strverscmp(const char *s1, const char *s2)
 }
 #endif
 
+static unsigned int
+dhcpcd_open_next(DHCPCD_CONNECTION *con, unsigned int state)
+{
+
+	state++;
+	/* Newer dhcpcd versions only have the one socket, so
+	 * work out if we are a privileged user. */
+	if (state == DHO_PRIVILEGED &&
+	    !(con->open_privileged && con->read_error))
+		state++;
+	return state;
+}
+
+static int
+dhcpcd_open_listen(DHCPCD_CONNECTION *con)
+{
+	int flags;
+
+	con->listen_fd = dhcpcd_connect(con->open_path);
+	if (con->listen_fd == -1)
+		return -1;
+	flags = fcntl(con->listen_fd, F_GETFL, 0);
+	if (flags == -1 ||
+	    fcntl(con->listen_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+	if (dhcpcd_command_send(con, con->listen_fd, false, "--listen") == -1)
+		return -1;
+	con->listen_ack = con->read_error;
+	return 0;
+}
+
+static int
+dhcpcd_open_send(DHCPCD_CONNECTION *con)
+{
+	const char *cmd;
+
+	/* We need the version to know if commands are terminated.
+	 * If they are not, dhcpcd cannot tell one from the next
+	 * so we have to wait for each reply before sending more. */
+	while (con->open_sent != DHO_INTERFACE &&
+	    (con->open_sent == con->open_state ||
+	    (con->open_state != DHO_VERSION && con->terminate_commands)))
+	{
+		switch (con->open_sent) {
+		case DHO_VERSION:
+			cmd = "--version";
+			break;
+		case DHO_CFFILE:
+			cmd = "--getconfigfile";
+			break;
+		case DHO_PRIVILEGED:
+			cmd = "--isprivileged";
+			break;
+		default:
+			/* Listen first so we don't miss any events */
+			if (dhcpcd_open_listen(con) == -1)
+				return -1;
+			cmd = "--getinterfaces";
+			break;
+		}
+		if (dhcpcd_command_send(con, con->command_fd,
+		    false, cmd) == -1)
+			return -1;
+		con->open_sent = dhcpcd_open_next(con, con->open_sent);
+	}
+	return 0;
+}
+
+/* Take a length prefixed string from the receive buffer.
+ * Returns 1 if taken, 0 if we need more data or -1 on error. */
+static int
+dhcpcd_open_string(DHCPCD_CONNECTION *con, char **buffer)
+{
+	size_t len;
+	char *nbuf;
+
+	if (con->cmd_recv.len - con->cmd_recv.pos < sizeof(len))
+		return 0;
+	memcpy(&len, con->cmd_recv.buf + con->cmd_recv.pos, sizeof(len));
+	if (len == 0 || len >= SSIZE_MAX - sizeof(len)) {
+		errno = len == 0 ? EINVAL : ENOBUFS;
+		return -1;
+	}
+	if (con->cmd_recv.len - con->cmd_recv.pos - sizeof(len) < len)
+		return 0;
+	nbuf = realloc(*buffer, len + 1);
+	if (nbuf == NULL)
+		return -1;
+	memcpy(nbuf, con->cmd_recv.buf + con->cmd_recv.pos + sizeof(len), len);
+	nbuf[len] = '\0';
+	*buffer = nbuf;
+	con->cmd_recv.pos += sizeof(len) + len;
+	return 1;
+}
+
+/* Take the reply to --getinterfaces, which is the number of
+ * interfaces to follow, preceeded by an error code for dhcpcd-10.5.0. */
+static int
+dhcpcd_open_interfaces(DHCPCD_CONNECTION *con)
+{
+	size_t need;
+	int error;
+
+	need = sizeof(con->open_nifs);
+	if (con->read_error)
+		need += sizeof(error);
+	if (con->cmd_recv.len - con->cmd_recv.pos < need)
+		return 0;
+	if (con->read_error) {
+		memcpy(&error, con->cmd_recv.buf + con->cmd_recv.pos, sizeof(error));
+		con->cmd_recv.pos += sizeof(error);
+		con->error = error;
+		if (error != 0) {
+			/* No interfaces follow */
+			con->open_nifs = 0;
+			return 1;
+		}
+	}
+	memcpy(&con->open_nifs, con->cmd_recv.buf + con->cmd_recv.pos,
+	    sizeof(con->open_nifs));
+	con->cmd_recv.pos += sizeof(con->open_nifs);
+	return 1;
+}
+
+static int
+dhcpcd_open_reply(DHCPCD_CONNECTION *con)
+{
+	char *priv;
+	DHCPCD_IF *i;
+	int r;
+
+	switch (con->open_state) {
+	case DHO_VERSION:
+		r = dhcpcd_open_string(con, &con->version);
+		if (r != 1)
+			return r;
+		con->terminate_commands =
+		    strverscmp(con->version, "6.4.1") >= 0 ? true : false;
+		con->read_error =
+		    strverscmp(con->version, "10.5.0") >= 0 ? true : false;
+		break;
+	case DHO_CFFILE:
+		r = dhcpcd_open_string(con, &con->cffile);
+		if (r != 1)
+			return r;
+		con->open = true;
+		con->privileged = con->open_privileged;
+		break;
+	case DHO_PRIVILEGED:
+		priv = NULL;
+		r = dhcpcd_open_string(con, &priv);
+		if (r != 1)
+			return r;
+		con->privileged = strcmp(priv, "true") == 0 ? true : false;
+		free(priv);
+		break;
+	case DHO_INTERFACES:
+		r = dhcpcd_open_interfaces(con);
+		if (r != 1)
+			return r;
+		break;
+	default:
+		/* We don't dispatch each interface here as that
+		 * causes too much notification spam when the GUI starts.
+		 * Some interface states we do not create an interface for
+		 * such as DHS_INFORM. */
+		while (con->open_nifs != 0) {
+			r = dhcpcd_recv_if(con, &con->cmd_recv, &i);
+			if (r != 1)
+				return r;
+			con->open_nifs--;
+		}
+		con->open_state = DHO_NONE;
+		return 1;
+	}
+
+	con->open_state = dhcpcd_open_next(con, con->open_state);
+	if (con->open_state == DHO_INTERFACES)
+		update_status(con, DHC_UNKNOWN);
+	return 1;
+}
+
+/* We may have the --listen reply already. If not,
+ * dhcpcd_dispatch will take it with the first event.
+ * Only the reply is read so no event is left sitting in the buffer.
+ * Returns 1 if it was taken, 0 if not yet or -1 on error. */
+static int
+dhcpcd_open_ack(DHCPCD_CONNECTION *con)
+{
+	ssize_t bytes;
+
+	if (!con->listen_ack)
+		return 1;
+	if (con->recv.len - con->recv.pos < sizeof(con->error)) {
+		bytes = dhcpcd_recv_fd(&con->recv, con->listen_fd,
+		    con->recv.pos + sizeof(con->error));
+		if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (bytes == 0)
+			errno = ECONNRESET;
+		if (bytes == 0 || bytes == -1)
+			return -1;
+	}
+	return dhcpcd_recv_ack(con);
+}
+
 int
-dhcpcd_open(DHCPCD_CONNECTION *con)
+dhcpcd_open_start(DHCPCD_CONNECTION *con)
 {
-	bool privileged = false, read_error = false;
+	bool privileged = false;
 	const char *path;
-	ssize_t bytes;
-	size_t nifs, n;
-	int fd, flags;
+	int fd, flags, error;
 
 	assert(con);
+	if (con->open_state != DHO_NONE) {
+		errno = EALREADY;
+		return -1;
+	}
 	if (con->open) {
-		if (con->listen_fd != -1)
-			return con->listen_fd;
 		errno = EISCONN;
 		return -1;
 	}
 
-	/* We need to block the command fd */
 	path = DHCPCD_SOCKET;
 	fd = dhcpcd_connect(path);
 	if (fd == -1) {
@@ -1081,74 +2152,324 @@ dhcpcd_open(DHCPCD_CONNECTION *con)
 		goto err_exit;
 	con->command_fd = fd;
 	con->error = 0;
-
-	con->terminate_commands = false;
-	if (dhcpcd_ctrl_command(con, "--version", &con->version) <= 0)
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
 		goto err_exit;
-	con->terminate_commands =
-	    strverscmp(con->version, "6.4.1") >= 0 ? true : false;
-	read_error =
-	    strverscmp(con->version, "10.5.0") >= 0 ? true : false;
 
-	if (dhcpcd_ctrl_command(con, "--getconfigfile", &con->cffile) <= 0)
+	con->terminate_commands = false;
+	con->read_error = false;
+	con->open_path = path;
+	con->open_privileged = privileged;
+	con->open_started = dhcpcd_now();
+	con->open_time = 0;
+	con->open_state = con->open_sent = DHO_VERSION;
+	if (dhcpcd_open_send(con) == -1)
 		goto err_exit;
+	return fd;
 
-	con->open = true;
-	con->privileged = privileged;
+err_exit:
+	error = errno;
+	dhcpcd_close(con);
+	errno = error;
+	return -1;
+}
 
-	/* Newer dhcpcd versions only have the one socket, so
-	 * work out if we are a privileged user. */
-	if (privileged && read_error) {
-		char *priv = NULL;
+int
+dhcpcd_open_dispatch(DHCPCD_CONNECTION *con)
+{
+	ssize_t bytes;
+	int r, error;
 
-		if (dhcpcd_ctrl_command(con, "--isprivileged", &priv) <= 0)
-			goto err_exit;
-		con->privileged = strcmp(priv, "true") == 0 ? true : false;
-		free(priv);
+	assert(con);
+	if (con->open_state == DHO_NONE) {
+		if (con->open)
+			return 1;
+		errno = ENOTCONN;
+		return -1;
 	}
 
-	update_status(con, DHC_UNKNOWN);
-
-	con->listen_fd = dhcpcd_connect(path);
-	if (con->listen_fd == -1)
+	bytes = dhcpcd_recv_fd(&con->cmd_recv, con->command_fd,
+	    con->cmd_recv.len + DHCPCD_RECV_SIZE);
+	if (bytes == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (bytes == 0)
+		errno = ECONNRESET;
+	if (bytes == 0 || bytes == -1)
 		goto err_exit;
 
-	/* We are now reading errors */
-	con->read_error = read_error;
-	bytes = dhcpcd_command_fd(con, con->listen_fd, false, "--listen", NULL);
-	if (bytes == -1)
-		goto out;
-	flags = fcntl(con->listen_fd, F_GETFD, 0);
-	if (flags == -1)
+	for (;;) {
+		r = dhcpcd_open_reply(con);
+		/* The status callback may have closed us */
+		if (con->command_fd == -1) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		if (r != 1 || con->open_state == DHO_NONE)
+			break;
+		if (dhcpcd_open_send(con) == -1)
+			goto err_exit;
+	}
+	if (r == -1)
 		goto err_exit;
-	flags |= O_NONBLOCK;
-	if (fcntl(con->listen_fd, F_SETFD, flags) == -1)
+	dhcpcd_recv_compact(&con->cmd_recv);
+	if (r == 0)
+		return 0;
+
+	con->open_time = (unsigned int)(dhcpcd_now() - con->open_started);
+	if (dhcpcd_open_ack(con) == -1)
 		goto err_exit;
+	update_status(con, con->error == 0 ? DHC_UNKNOWN: DHC_OPENED);
+	return 1;
 
-	bytes = dhcpcd_command_fd(con, con->command_fd, false, "--getinterfaces", NULL);
-	if (bytes == -1)
-		goto out;
+err_exit:
+	error = errno;
+	dhcpcd_close(con);
+	errno = error;
+	return -1;
+}
 
-	bytes = read(con->command_fd, &nifs, sizeof(nifs));
-	if (bytes != sizeof(nifs))
-		goto err_exit;
+int
+dhcpcd_open(DHCPCD_CONNECTION *con)
+{
+	struct pollfd pfd;
+	int r;
 
-	/* We don't dispatch each interface here as that
-	 * causes too much notification spam when the GUI starts */
-	for (n = 0; n < nifs; n++) {
-		/* Some interface states we do not create an interface for
-		 * such as DHS_INFORM. */
-		dhcpcd_read_if(con, con->command_fd);
+	assert(con);
+	if (con->open && con->open_state == DHO_NONE) {
+		if (con->listen_fd != -1)
+			return con->listen_fd;
+		errno = EISCONN;
+		return -1;
 	}
 
-out:
-	update_status(con, con->error == 0 ? DHC_UNKNOWN: DHC_OPENED);
+	if (con->open_state == DHO_NONE && dhcpcd_open_start(con) == -1)
+		return -1;
+	pfd.fd = con->command_fd;
+	pfd.events = POLLIN;
+	while ((r = dhcpcd_open_dispatch(con)) == 0) {
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			r = errno;
+			dhcpcd_close(con);
+			errno = r;
+			return -1;
+		}
+	}
+	return r == 1 ? con->listen_fd : -1;
+}
 
-	return con->listen_fd;
+unsigned int
+dhcpcd_open_time(const DHCPCD_CONNECTION *con)
+{
 
-err_exit:
-	dhcpcd_close(con);
+	assert(con);
+	return con->open_time;
+}
+
+/* When dhcpcd is not running we wait for one of its sockets to appear
+ * rather than polling for it. On Linux this uses inotify, elsewhere
+ * the caller retries on a jittered exponential backoff. */
+#ifdef __linux__
+static const char * const dhcpcd_sockets[DHCPCD_NSOCKETS] = {
+	DHCPCD_SOCKET,
+	DHCPCD_UNPRIV_SOCKET,
+	DHCPCD_OSOCKET,
+	DHCPCD_UNPRIV_OSOCKET,
+};
+
+#define DHCPCD_WAIT_MASK	(IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+
+/* Watch the directory of socket n, or its parent if the
+ * directory has yet to be created. */
+static void
+dhcpcd_wait_add(DHCPCD_CONNECTION *con, size_t n)
+{
+	char dir[PATH_MAX], *p;
+
+	con->wait_wd[n] = con->wait_pwd[n] = -1;
+	strlcpy(dir, dhcpcd_sockets[n], sizeof(dir));
+	if ((p = strrchr(dir, '/')) == NULL)
+		return;
+	*p = '\0';
+	con->wait_wd[n] = inotify_add_watch(con->wait_fd, dir,
+	    DHCPCD_WAIT_MASK);
+	if (con->wait_wd[n] != -1 || errno != ENOENT)
+		return;
+	if ((p = strrchr(dir, '/')) == NULL)
+		return;
+	*p = '\0';
+	con->wait_pwd[n] = inotify_add_watch(con->wait_fd,
+	    *dir == '\0' ? "/" : dir, DHCPCD_WAIT_MASK);
+}
+
+/* Does the event name match the last path component of path? */
+static bool
+dhcpcd_wait_match(const char *path, size_t len, const char *name)
+{
+	const char *p;
+	size_t l;
+
+	for (p = path + len; p != path && *(p - 1) != '/'; p--)
+		;
+	l = (size_t)(path + len - p);
+	return strncmp(p, name, l) == 0 && name[l] == '\0';
+}
+#endif
+
+int
+dhcpcd_wait_start(DHCPCD_CONNECTION *con)
+{
+#ifdef __linux__
+	size_t n;
+	bool watching;
+	int error;
+#endif
+
+	assert(con);
+	if (con->wait_seed == 0)
+		con->wait_seed = ((uint32_t)dhcpcd_now() ^
+		    ((uint32_t)getpid() << 16)) | 1;
+	if (con->wait_fd != -1)
+		return con->wait_fd;
+
+#ifdef __linux__
+	con->wait_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (con->wait_fd == -1)
+		return -1;
+	watching = false;
+	for (n = 0; n < DHCPCD_NSOCKETS; n++) {
+		dhcpcd_wait_add(con, n);
+		if (con->wait_wd[n] != -1 || con->wait_pwd[n] != -1)
+			watching = true;
+	}
+	if (!watching) {
+		error = errno;
+		close(con->wait_fd);
+		con->wait_fd = -1;
+		errno = error;
+	}
+	return con->wait_fd;
+#else
+	errno = ENOTSUP;
 	return -1;
+#endif
+}
+
+/* Returns true if a socket may have appeared and we should
+ * try to open the connection. */
+bool
+dhcpcd_wait_dispatch(DHCPCD_CONNECTION *con)
+{
+#ifdef __linux__
+	union {
+		struct inotify_event ev;
+		char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	} u[4];
+	const struct inotify_event *ev;
+	const char *sock;
+	char *p, *end;
+	ssize_t bytes;
+	size_t n, l;
+	bool found;
+
+	assert(con);
+	found = false;
+	while ((bytes = read(con->wait_fd, u, sizeof(u))) > 0) {
+		end = (char *)u + bytes;
+		for (p = (char *)u; p < end;
+		    p += sizeof(*ev) + ev->len)
+		{
+			ev = (const struct inotify_event *)(void *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				found = true;
+				continue;
+			}
+			for (n = 0; n < DHCPCD_NSOCKETS; n++) {
+				sock = dhcpcd_sockets[n];
+				l = strlen(sock);
+				if (ev->wd == con->wait_wd[n]) {
+					/* Directory removed, wait for it
+					 * to come back. */
+					if (ev->mask & IN_IGNORED)
+						dhcpcd_wait_add(con, n);
+					else if (ev->len != 0 &&
+					    dhcpcd_wait_match(sock, l,
+					    ev->name))
+						found = true;
+				} else if (ev->wd == con->wait_pwd[n] &&
+				    ev->len != 0)
+				{
+					/* Step back over the socket name
+					 * to match the directory. */
+					while (l != 0 && sock[l - 1] != '/')
+						l--;
+					if (l != 0 &&
+					    dhcpcd_wait_match(sock, l - 1,
+					    ev->name))
+					{
+						/* The socket could already
+						 * be there. */
+						dhcpcd_wait_add(con, n);
+						found = true;
+					}
+				}
+			}
+		}
+	}
+	/* dhcpcd may not be listening on the socket just yet */
+	if (found) {
+		con->wait_backoff = 0;
+		con->wait_retry = true;
+	}
+	return found;
+#else
+	assert(con);
+	return true;
+#endif
+}
+
+/* Milliseconds until the caller should try again
+ * or -1 if it should just wait for our fd. */
+int
+dhcpcd_wait_timeout(DHCPCD_CONNECTION *con)
+{
+	unsigned int ms;
+	uint32_t r;
+
+	assert(con);
+	if (con->wait_fd != -1) {
+		if (con->wait_retry &&
+		    con->wait_backoff >= DHCPCD_RETRYOPEN_MAX)
+			con->wait_retry = false;
+		if (!con->wait_retry)
+			return -1;
+	}
+
+	ms = con->wait_backoff;
+	if (ms < DHCPCD_RETRYOPEN)
+		ms = DHCPCD_RETRYOPEN;
+	con->wait_backoff = ms * 2 > DHCPCD_RETRYOPEN_MAX ?
+	    DHCPCD_RETRYOPEN_MAX : ms * 2;
+
+	/* xorshift32 is good enough to stop us all waking at once */
+	r = con->wait_seed;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	con->wait_seed = r;
+	return (int)(ms / 2 + r % (ms / 2 + 1));
+}
+
+void
+dhcpcd_wait_stop(DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	if (con->wait_fd != -1) {
+		close(con->wait_fd);
+		con->wait_fd = -1;
+	}
+	con->wait_backoff = 0;
+	con->wait_retry = false;
 }
 
 int
@@ -1235,7 +2556,6 @@ dhcpcd_close(DHCPCD_CONNECTION *con)
 {
 	DHCPCD_IF *nif;
 	DHCPCD_WPA *nwpa;
-	DHCPCD_WI_HIST *nh;
 
 	assert(con);
 
@@ -1255,16 +2575,15 @@ dhcpcd_close(DHCPCD_CONNECTION *con)
 		free(con->wpa);
 		con->wpa = nwpa;
 	}
-	while (con->wi_history) {
-		nh = con->wi_history->next;
-		free(con->wi_history);
-		con->wi_history = nh;
-	}
+	dhcpcd_wi_history_clear(con);
+	dhcpcd_hmap_clear(&con->wpa_map);
+	dhcpcd_hmap_clear(&con->if_map);
+	free(con->links);
+	con->links = NULL;
+	con->links_len = con->links_size = 0;
 	while (con->interfaces) {
 		nif = con->interfaces->next;
-		free(con->interfaces->data);
-		free(con->interfaces->last_message);
-		free(con->interfaces);
+		dhcpcd_if_free(con->interfaces);
 		con->interfaces = nif;
 	}
 
@@ -1279,6 +2598,11 @@ dhcpcd_close(DHCPCD_CONNECTION *con)
 		con->listen_fd = -1;
 	}
 
+	dhcpcd_command_flush(con);
+	dhcpcd_order_free(con);
+	con->open_state = DHO_NONE;
+	con->listen_ack = false;
+
 	if (con->cffile) {
 		free(con->cffile);
 		con->cffile = NULL;
@@ -1292,6 +2616,8 @@ dhcpcd_close(DHCPCD_CONNECTION *con)
 		con->buf = NULL;
 		con->buflen = 0;
 	}
+	dhcpcd_recv_free(&con->recv);
+	dhcpcd_recv_free(&con->cmd_recv);
 }
 
 void
@@ -1299,6 +2625,9 @@ dhcpcd_free(DHCPCD_CONNECTION *con)
 {
 
 	assert(con);
+	dhcpcd_wait_stop(con);
+	if (con->wpa_dir_fd != -1)
+		close(con->wpa_dir_fd);
 	free(con);
 }
 
@@ -1310,8 +2639,8 @@ dhcpcd_if_connection(DHCPCD_IF *i)
 	return i->con;
 }
 
-char *
-dhcpcd_if_message(DHCPCD_IF *i, bool *new_msg)
+static char *
+dhcpcd_if_message1(DHCPCD_IF *i)
 {
 	const char *ip, *iplen, *pfx;
 	char *msg, *p;
@@ -1338,15 +2667,13 @@ dhcpcd_if_message(DHCPCD_IF *i, bool *new_msg)
 		} else {
 			/* Don't report able in if we have addresses */
 			const DHCPCD_IF *ci;
+			unsigned int type;
 
-			for (ci = i->con->interfaces; ci; ci = ci->next) {
-				if (ci != i &&
-				    strcmp(i->ifname, ci->ifname) == 0 &&
-				    ci->up)
-					break;
+			for (type = DHT_LINK; type < DHT_MAX; type++) {
+				ci = dhcpcd_get_if(i->con, i->ifname, type);
+				if (ci != NULL && ci != i && ci->up)
+					return NULL;
 			}
-			if (ci)
-				return NULL;
 			reason = _("Link is up, configuring");
 		}
 		break;
@@ -1430,15 +2757,43 @@ dhcpcd_if_message(DHCPCD_IF *i, bool *new_msg)
 		snprintf(p, len - (size_t)(p - msg), " %s/%s", ip, iplen);
 	else if (ip)
 		snprintf(p, len - (size_t)(p - msg), " %s", ip);
+	return msg;
+}
 
-	if (new_msg) {
-		if (i->last_message == NULL || strcmp(i->last_message, msg))
-			*new_msg = true;
-		else
-			*new_msg = false;
+/* The message is cached until the interface or a sibling changes.
+ * The returned string belongs to the interface. */
+const char *
+dhcpcd_if_get_message(DHCPCD_IF *i, bool *new_msg)
+{
+	char *msg;
+
+	assert(i);
+	if (!i->message_valid) {
+		msg = dhcpcd_if_message1(i);
+		if (msg != NULL) {
+			if (i->last_message == NULL ||
+			    strcmp(i->last_message, msg) != 0)
+				i->message_new = true;
+			free(i->last_message);
+			i->last_message = msg;
+		}
+		i->message = msg;
+		i->message_valid = true;
 	}
-	free(i->last_message);
-	i->last_message = strdup(msg);
 
-	return msg;
+	if (i->message != NULL) {
+		if (new_msg)
+			*new_msg = i->message_new;
+		i->message_new = false;
+	}
+	return i->message;
+}
+
+char *
+dhcpcd_if_message(DHCPCD_IF *i, bool *new_msg)
+{
+	const char *msg;
+
+	msg = dhcpcd_if_get_message(i, new_msg);
+	return msg == NULL ? NULL : strdup(msg);
 }
@@ -31,6 +31,7 @@
 #include <netinet/in.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -61,11 +62,16 @@ extern "C" {
 #endif
 
 #define DHCPCD_RETRYOPEN	100	/* milliseconds */
+#define DHCPCD_DAMPING		500	/* milliseconds */
 #define DHCPCD_RETRYOPEN_EPERM	1000 * 60	/* milliseconds */
-#define DHCPCD_WPA_PING		500	/* milliseconds */
+#define DHCPCD_RETRYOPEN_MAX	10000	/* milliseconds */
+#define DHCPCD_WPA_PING		60000	/* milliseconds, when idle */
+#define DHCPCD_WPA_TIMEOUT	2000	/* milliseconds */
 #define DHCPCD_WPA_SCAN_LONG	60000	/* milliseconds */
 #define DHCPCD_WPA_SCAN_SHORT	5000	/* milliseconds */
+#define DHCPCD_WPA_SCAN_MAX	240000	/* milliseconds, when stable */
 #define DHCPCD_WI_HIST_MAX	10	/* Recall 10 scans for averages */
+#define DHCPCD_WI_HIST_EXPIRE	300000	/* milliseconds, forget unseen BSS */
 
 /* Each non printable byte of the SSID is represented as \000 */
 #define IF_SSIDSIZE		((32 * 4) + 1)
@@ -129,6 +135,13 @@ typedef struct dhcpcd_wi_avs {
 	int average;
 } DHCPCD_WI_AV;
 
+/* One of the BSSes making up a DHCPCD_WI_SCAN */
+typedef struct dhcpcd_wi_bss {
+	char bssid[IF_BSSIDSIZE];
+	int frequency;
+	DHCPCD_WI_AV strength;
+} DHCPCD_WI_BSS;
+
 typedef struct dhcpcd_wi_scan {
 	struct dhcpcd_wi_scan *next;
 	char bssid[IF_BSSIDSIZE];
@@ -148,7 +161,43 @@ typedef struct dhcpcd_wi_scan {
 	char wpa_flags[FLAGSIZE];
 } DHCPCD_WI_SCAN;
 
+typedef struct dhcpcd_command_stats {
+	size_t pending;
+	size_t pending_max;
+	unsigned long completed;
+	unsigned int latency;		/* milliseconds, last reply */
+	unsigned int latency_max;	/* milliseconds */
+	uint64_t latency_total;		/* milliseconds */
+} DHCPCD_COMMAND_STATS;
+
+typedef struct dhcpcd_wpa_scan_stats {
+	unsigned long batches;		/* dhcpcd_wi_scans results built */
+	unsigned long allocs;		/* heap allocations to build them */
+} DHCPCD_WPA_SCAN_STATS;
+
 #ifdef IN_LIBDHCPCD
+typedef struct dhcpcd_hmap_slot {
+	uint32_t hash;
+	void *item;
+} DHCPCD_HMAP_SLOT;
+
+typedef struct dhcpcd_hmap {
+	DHCPCD_HMAP_SLOT *slots;
+	size_t size;
+	size_t len;
+} DHCPCD_HMAP;
+
+#define	DHCPCD_HASH_INIT	0x811c9dc5U
+uint32_t dhcpcd_hash(uint32_t, const void *, size_t);
+int dhcpcd_hmap_add(DHCPCD_HMAP *, uint32_t, void *);
+void *dhcpcd_hmap_find(const DHCPCD_HMAP *, uint32_t,
+    bool (*)(const void *, const void *), const void *);
+void *dhcpcd_hmap_del(DHCPCD_HMAP *, uint32_t,
+    bool (*)(const void *, const void *), const void *);
+void dhcpcd_hmap_clear(DHCPCD_HMAP *);
+
+uint64_t dhcpcd_now(void);
+
 typedef struct dhcpcd_if {
 	struct dhcpcd_if *next;
 	const char *ifname;
@@ -164,8 +213,21 @@ typedef struct dhcpcd_if {
 
 	char *data;
 	size_t data_len;
+	uint32_t *data_index;
+	uint32_t data_index_mask;
 
 	char *last_message;
+	const char *message;
+	bool message_valid;
+	bool message_new;
+	size_t order_rank;
+
+	/* Flap damping */
+	struct dhcpcd_if *damp_next;
+	struct dhcpcd_if **damp_prev;
+	uint64_t damp_until;
+	bool damp_pending;
+	size_t damped;
 
 	struct dhcpcd_connection *con;
 } DHCPCD_IF;
@@ -192,15 +254,97 @@ typedef struct dhcpcd_config {
 } DHCPCD_OPTION;
 
 #ifdef IN_LIBDHCPCD
+typedef struct dhcpcd_wi_sample {
+	int quality;
+	int noise;
+	int level;
+	int strength;
+} DHCPCD_WI_SAMPLE;
+
+/* dhcpcd_wi_scans returns an array of these linked through scan.next,
+ * so DHCPCD_WI_SCAN keeps its size and the members are found from it.
+ * bss is every BSS with the SSID, strongest first. */
+typedef struct dhcpcd_wi_scan_entry {
+	DHCPCD_WI_SCAN scan;
+	DHCPCD_WI_BSS *bss;
+	size_t bss_len;
+} DHCPCD_WI_SCAN_ENTRY;
+
+/* Ring of the last samples for a BSS, pos is the next to replace */
 typedef struct dhcpcd_wi_hist {
 	struct dhcpcd_wi_hist *next;
 	char ifname[IF_NAMESIZE];
 	char bssid[IF_BSSIDSIZE];
+	uint64_t seen;
+	size_t len;
+	size_t pos;
+	DHCPCD_WI_SAMPLE samples[DHCPCD_WI_HIST_MAX];
+} DHCPCD_WI_HIST;
+
+/* The flags text of a BSS, shared by every BSS with the same. */
+typedef struct dhcpcd_wpa_flags {
+	size_t refs;
+	uint32_t hash;
+	char text[];
+} DHCPCD_WPA_FLAGS;
+
+/* What we keep of each BSS. DHCPCD_WI_SCAN with its textual
+ * bssid, ssid and flags is only made when results are asked for. */
+#define WPA_BSSID_LEN		6
+#define WPA_SSID_LEN		32
+typedef struct dhcpcd_wpa_bss {
+	unsigned int id;
+	unsigned int age;
+	unsigned int gen;
+	unsigned int flags;
+#define WBF_WPS			0x001U
+#define WBF_WEP			0x002U
+#define WBF_MESH		0x004U
+#define WBF_ESS			0x008U
+#define WBF_IBSS		0x010U
+#define WBF_P2P			0x020U
+#define WBF_HS20		0x040U
+	unsigned int ie[2];		/* WPA or RSN proto, akm and ciphers */
+	DHCPCD_WPA_FLAGS *text;		/* flags as given */
+	int frequency;
 	int quality;
 	int noise;
 	int level;
 	int strength;
-} DHCPCD_WI_HIST;
+	bool bssid_set;
+	uint8_t bssid[WPA_BSSID_LEN];
+	uint8_t ssid_len;
+	uint8_t ssid[WPA_SSID_LEN];
+} DHCPCD_WPA_BSS;
+
+/* Scan results are sorted on these rather than on the BSS table.
+ * key is the case folded start of the escaped SSID followed by the
+ * inverted strength, so most comparisons never look at the SSID itself. */
+#define WBK_PREFIX_LEN		15
+#define WBK_STRENGTH		0xff
+typedef struct dhcpcd_wpa_bss_key {
+	uint64_t key[2];
+	uint32_t hash;			/* of the whole SSID */
+	DHCPCD_WPA_BSS *bss;
+} DHCPCD_WPA_BSS_KEY;
+
+typedef struct dhcpcd_wpa_net {
+	int id;
+	unsigned int flags;
+#define WNF_CURRENT		0x001U
+#define WNF_DISABLED		0x002U
+	char ssid[IF_SSIDSIZE];
+	char key_mgmt[32];
+} DHCPCD_WPA_NET;
+
+struct dhcpcd_wpa;
+typedef struct dhcpcd_wpa_cmd {
+	struct dhcpcd_wpa_cmd *next;
+	char *cmd;
+	uint64_t sent;
+	void (*cb)(struct dhcpcd_wpa *, int, const char *, size_t, void *);
+	void *cb_context;
+} DHCPCD_WPA_CMD;
 
 typedef struct dhcpcd_wpa {
 	struct dhcpcd_wpa *next;
@@ -210,10 +354,58 @@ typedef struct dhcpcd_wpa {
 	char *command_path;
 	int listen_fd;
 	char *listen_path;
+	char *event_buf;
 	bool attached;
+	bool bss_nomask;
+	bool bss_loaded;
+	bool bss_busy;			/* walking the table */
+	bool bss_rescan;		/* scan results came in meanwhile */
+	DHCPCD_WPA_BSS *bss;
+	size_t bss_len;
+	size_t bss_size;
+	unsigned int bss_gen;
+	DHCPCD_HMAP flags_map;
+	DHCPCD_WPA_BSS_KEY *bss_order;
+	size_t bss_order_size;
+	DHCPCD_WPA_SCAN_STATS scan_stats;
+	bool net_loaded;
+	DHCPCD_WPA_NET *net;
+	size_t net_len;
+	size_t net_size;
+	DHCPCD_HMAP net_map;
+	uint64_t ping_due;
+	uint64_t select_started;
+	unsigned int select_time;
+	char bssid[IF_BSSIDSIZE];
+	uint64_t roamed;
+	bool menu_open;
+	uint64_t scan_due;
+	unsigned int scan_interval;
+	DHCPCD_WPA_CMD *cmd_head;
+	DHCPCD_WPA_CMD **cmd_tail;
+	DHCPCD_WPA_CMD *cmd_unsent;
+	size_t cmd_inflight;
+	char *cmd_reply;
 	struct dhcpcd_connection *con;
 } DHCPCD_WPA;
 
+typedef struct dhcpcd_cmd {
+	struct dhcpcd_cmd *next;
+	bool error;
+	bool reply;
+	uint64_t sent;
+	void (*cb)(struct dhcpcd_connection *, int, const char *, size_t,
+	    void *);
+	void *cb_context;
+} DHCPCD_CMD;
+
+typedef struct dhcpcd_rbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+} DHCPCD_RBUF;
+
 typedef struct dhcpcd_connection {
 	struct dhcpcd_connection *next;
 	bool open;
@@ -227,6 +419,7 @@ typedef struct dhcpcd_connection {
 	DHCPCD_IF *interfaces;
 	DHCPCD_WPA *wpa;
 	DHCPCD_WI_HIST *wi_history;
+	DHCPCD_HMAP wi_history_map;
 
 	void (*if_cb)(DHCPCD_IF *, void *);
 	void *if_context;
@@ -234,6 +427,8 @@ typedef struct dhcpcd_connection {
 	    unsigned int, const char *, void *);
 	void *status_context;
 	bool wpa_started;
+	int wpa_dir_fd;
+	int wpa_dir_wd;
 	void (*wi_scanresults_cb)(DHCPCD_WPA *, void *);
 	void *wi_scanresults_context;
 	void (*wpa_status_cb)(DHCPCD_WPA *, unsigned int, const char *, void *);
@@ -242,13 +437,53 @@ typedef struct dhcpcd_connection {
 	char *buf;
 	size_t buflen;
 
+	DHCPCD_RBUF recv;
+	DHCPCD_RBUF cmd_recv;
+	DHCPCD_CMD *cmd_head;
+	DHCPCD_CMD **cmd_tail;
+	DHCPCD_COMMAND_STATS cmd_stats;
+
 	char *version;
 	bool terminate_commands;
 	bool read_error;
+	bool listen_ack;
 	unsigned int status;
 	bool af_waiting;
 
 	char *cffile;
+
+	unsigned int open_state;
+	unsigned int open_sent;
+	const char *open_path;
+	bool open_privileged;
+	size_t open_nifs;
+	uint64_t open_started;
+	unsigned int open_time;
+
+#define DHCPCD_NSOCKETS		4
+	int wait_fd;
+	int wait_wd[DHCPCD_NSOCKETS];
+	int wait_pwd[DHCPCD_NSOCKETS];
+	unsigned int wait_backoff;
+	bool wait_retry;
+	uint32_t wait_seed;
+
+	char *order;
+	size_t order_len;
+	const char **order_names;
+	size_t order_nnames;
+	DHCPCD_HMAP order_map;
+
+	unsigned int damping;
+	DHCPCD_IF *damp_head;
+	DHCPCD_IF **damp_tail;
+	size_t damped;
+
+	DHCPCD_HMAP if_map;
+	DHCPCD_IF **links;
+	size_t links_len;
+	size_t links_size;
+	DHCPCD_HMAP wpa_map;
 } DHCPCD_CONNECTION;
 
 #else
@@ -267,6 +502,13 @@ bool dhcpcd_af_waiting(const DHCPCD_CONNECTION *);
 const char * dhcpcd_cffile(DHCPCD_CONNECTION *);
 bool dhcpcd_realloc(DHCPCD_CONNECTION *, size_t);
 int dhcpcd_open(DHCPCD_CONNECTION *);
+int dhcpcd_open_start(DHCPCD_CONNECTION *);
+int dhcpcd_open_dispatch(DHCPCD_CONNECTION *);
+unsigned int dhcpcd_open_time(const DHCPCD_CONNECTION *);
+int dhcpcd_wait_start(DHCPCD_CONNECTION *);
+bool dhcpcd_wait_dispatch(DHCPCD_CONNECTION *);
+int dhcpcd_wait_timeout(DHCPCD_CONNECTION *);
+void dhcpcd_wait_stop(DHCPCD_CONNECTION *);
 void dhcpcd_close(DHCPCD_CONNECTION *);
 void dhcpcd_free(DHCPCD_CONNECTION *);
 void dhcpcd_set_if_callback(DHCPCD_CONNECTION *,
@@ -276,6 +518,13 @@ void dhcpcd_set_status_callback(DHCPCD_CONNECTION *,
 int dhcpcd_get_fd(DHCPCD_CONNECTION *);
 bool dhcpcd_privileged(DHCPCD_CONNECTION *);
 void dhcpcd_dispatch(DHCPCD_CONNECTION *);
+void dhcpcd_dispatch_all(DHCPCD_CONNECTION *);
+void dhcpcd_set_damping(DHCPCD_CONNECTION *, unsigned int);
+unsigned int dhcpcd_damping(const DHCPCD_CONNECTION *);
+size_t dhcpcd_damped(const DHCPCD_CONNECTION *);
+size_t dhcpcd_if_damped(const DHCPCD_IF *);
+int dhcpcd_get_timeout(DHCPCD_CONNECTION *);
+void dhcpcd_dispatch_timeout(DHCPCD_CONNECTION *);
 DHCPCD_IF * dhcpcd_interfaces(DHCPCD_CONNECTION *);
 char **dhcpcd_interface_names(DHCPCD_CONNECTION *, size_t *);
 void dhcpcd_freev(char **);
@@ -289,14 +538,32 @@ ssize_t dhcpcd_encode_string_escape(char *, size_t, const char *, size_t);
 ssize_t dhcpcd_decode_string_escape(char *, size_t, const char *);
 ssize_t dhcpcd_decode_hex(char *, size_t, const char *);
 char * dhcpcd_if_message(DHCPCD_IF *, bool *);
+const char * dhcpcd_if_get_message(DHCPCD_IF *, bool *);
 
 ssize_t dhcpcd_command(DHCPCD_CONNECTION *, const char *, char **);
 ssize_t dhcpcd_command_arg(DHCPCD_CONNECTION *, const char *, const char *,
     char **);
 #define dhcpcd_rebind(c, i)	dhcpcd_command_arg((c), "-n", (i), NULL)
 #define dhcpcd_release(c, i)	dhcpcd_command_arg((c), "-k", (i), NULL)
+/* The callback runs before dhcpcd_command_async returns when dhcpcd
+ * sends nothing back for the command and none are queued ahead of it.
+ * It may queue more commands or close the connection. */
+int dhcpcd_command_async(DHCPCD_CONNECTION *, const char *, const char *,
+    bool, void (*)(DHCPCD_CONNECTION *, int, const char *, size_t, void *),
+    void *);
+#define dhcpcd_rebind_async(c, i, cb, ctx)				      \
+	dhcpcd_command_async((c), "-n", (i), false, (cb), (ctx))
+#define dhcpcd_release_async(c, i, cb, ctx)				      \
+	dhcpcd_command_async((c), "-k", (i), false, (cb), (ctx))
+int dhcpcd_get_command_fd(DHCPCD_CONNECTION *);
+void dhcpcd_command_dispatch(DHCPCD_CONNECTION *);
+size_t dhcpcd_command_pending(const DHCPCD_CONNECTION *);
+const DHCPCD_COMMAND_STATS *dhcpcd_command_stats(const DHCPCD_CONNECTION *);
+const DHCPCD_WPA_SCAN_STATS *dhcpcd_wpa_scan_stats(const DHCPCD_WPA *);
 
 void dhcpcd_wpa_start(DHCPCD_CONNECTION *);
+int dhcpcd_wpa_get_dir_fd(DHCPCD_CONNECTION *);
+void dhcpcd_wpa_dir_dispatch(DHCPCD_CONNECTION *);
 DHCPCD_WPA *dhcpcd_wpa_find(DHCPCD_CONNECTION *, const char *);
 DHCPCD_WPA *dhcpcd_wpa_new(DHCPCD_CONNECTION *, const char *);
 DHCPCD_CONNECTION *dhcpcd_wpa_connection(DHCPCD_WPA *);
@@ -313,12 +580,22 @@ void dhcpcd_wpa_set_status_callback(DHCPCD_CONNECTION *,
 int dhcpcd_wi_scan_compare(DHCPCD_WI_SCAN *a, DHCPCD_WI_SCAN *b);
 DHCPCD_WI_SCAN * dhcpcd_wi_scans(DHCPCD_IF *);
 bool dhcpcd_wi_associated(DHCPCD_IF *i, DHCPCD_WI_SCAN *s);
+const DHCPCD_WI_BSS *dhcpcd_wi_scan_bss(const DHCPCD_WI_SCAN *, size_t *);
+const DHCPCD_WI_BSS *dhcpcd_wi_scan_best(const DHCPCD_WI_SCAN *,
+    unsigned int);
 void dhcpcd_wi_scans_free(DHCPCD_WI_SCAN *);
 void dhcpcd_wi_history_clear(DHCPCD_CONNECTION *);
 bool dhcpcd_wpa_set_network(DHCPCD_WPA *, int, const char *, const char *);
 int dhcpcd_wpa_find_network_new(DHCPCD_WPA *, const char *);
 bool dhcpcd_wpa_command(DHCPCD_WPA *, const char *);
 bool dhcpcd_wpa_command_arg(DHCPCD_WPA *, const char *, const char *);
+int dhcpcd_wpa_command_async(DHCPCD_WPA *, const char *,
+    void (*)(DHCPCD_WPA *, int, const char *, size_t, void *), void *);
+int dhcpcd_wpa_get_command_fd(DHCPCD_WPA *);
+void dhcpcd_wpa_command_dispatch(DHCPCD_WPA *);
+size_t dhcpcd_wpa_command_pending(const DHCPCD_WPA *);
+int dhcpcd_wpa_get_timeout(DHCPCD_WPA *);
+void dhcpcd_wpa_dispatch_timeout(DHCPCD_WPA *);
 unsigned int dhcpcd_wpa_status(DHCPCD_WPA *, const char **);
 int dhcpcd_wpa_freq(DHCPCD_WPA *);
 #define WST_BSSID	0x01
@@ -327,8 +604,10 @@ int dhcpcd_wpa_freq(DHCPCD_WPA *);
 int dhcpcd_wi_print_tooltip(char *, size_t, DHCPCD_WI_SCAN *, unsigned int);
 
 bool dhcpcd_wpa_ping(DHCPCD_WPA *);
+int dhcpcd_wpa_ping_async(DHCPCD_WPA *);
 bool dhcpcd_wpa_can_background_scan(DHCPCD_WPA *);
 bool dhcpcd_wpa_scan(DHCPCD_WPA *);
+void dhcpcd_wpa_set_menu_open(DHCPCD_WPA *, bool);
 bool dhcpcd_wpa_reconfigure(DHCPCD_WPA *);
 bool dhcpcd_wpa_reassociate(DHCPCD_WPA *);
 bool dhcpcd_wpa_disconnect(DHCPCD_WPA *);
@@ -353,6 +632,9 @@ bool dhcpcd_wpa_network_set(DHCPCD_WPA *, int, const char *, const char *);
 #define DHCPCD_WPA_ERR_RECONF	-9
 int dhcpcd_wpa_configure(DHCPCD_WPA *w, DHCPCD_WI_SCAN *s, const char *p);
 int dhcpcd_wpa_select(DHCPCD_WPA *w, DHCPCD_WI_SCAN *s);
+int dhcpcd_wpa_roam(DHCPCD_WPA *w, DHCPCD_WI_SCAN *s,
+    const DHCPCD_WI_BSS *b);
+unsigned int dhcpcd_wpa_select_time(const DHCPCD_WPA *);
 
 char ** dhcpcd_config_blocks(DHCPCD_CONNECTION *, const char *);
 DHCPCD_OPTION *dhcpcd_config_read(DHCPCD_CONNECTION *,
@@ -0,0 +1,186 @@
+/*
+ * libdhcpcd
+ * Copyright 2009-2015 Roy Marples <roy@marples.name>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define IN_LIBDHCPCD
+#include "dhcpcd.h"
+
+/*
+ * A small open addressed hash map with linear probing.
+ * We only store the hash and a pointer to the item,
+ * the caller supplies a match function to compare the item to a key.
+ */
+
+#define	HMAP_SIZE_MIN	16
+
+uint32_t
+dhcpcd_hash(uint32_t h, const void *data, size_t len)
+{
+	const unsigned char *p, *e;
+
+	/* FNV-1a */
+	p = data;
+	e = p + len;
+	while (p < e) {
+		h ^= *p++;
+		h *= 0x01000193U;
+	}
+	return h;
+}
+
+static int
+dhcpcd_hmap_grow(DHCPCD_HMAP *map)
+{
+	DHCPCD_HMAP_SLOT *slots, *s, *e;
+	size_t size, mask, pos;
+
+	size = map->size == 0 ? HMAP_SIZE_MIN : map->size * 2;
+	if (size < map->size) {
+		errno = ENOMEM;
+		return -1;
+	}
+	slots = calloc(size, sizeof(*slots));
+	if (slots == NULL)
+		return -1;
+
+	mask = size - 1;
+	e = map->slots + map->size;
+	for (s = map->slots; s < e; s++) {
+		if (s->item == NULL)
+			continue;
+		for (pos = s->hash & mask;
+		    slots[pos].item != NULL;
+		    pos = (pos + 1) & mask)
+			;
+		slots[pos] = *s;
+	}
+	free(map->slots);
+	map->slots = slots;
+	map->size = size;
+	return 0;
+}
+
+int
+dhcpcd_hmap_add(DHCPCD_HMAP *map, uint32_t hash, void *item)
+{
+	size_t mask, pos;
+
+	assert(map);
+	assert(item);
+
+	/* Keep the load factor under a half */
+	if ((map->len + 1) * 2 > map->size && dhcpcd_hmap_grow(map) == -1)
+		return -1;
+
+	mask = map->size - 1;
+	for (pos = hash & mask;
+	    map->slots[pos].item != NULL;
+	    pos = (pos + 1) & mask)
+		;
+	map->slots[pos].hash = hash;
+	map->slots[pos].item = item;
+	map->len++;
+	return 0;
+}
+
+static DHCPCD_HMAP_SLOT *
+dhcpcd_hmap_slot(const DHCPCD_HMAP *map, uint32_t hash,
+    bool (*match)(const void *, const void *), const void *key)
+{
+	DHCPCD_HMAP_SLOT *s;
+	size_t mask, pos;
+
+	if (map->len == 0)
+		return NULL;
+	mask = map->size - 1;
+	for (pos = hash & mask; ; pos = (pos + 1) & mask) {
+		s = &map->slots[pos];
+		if (s->item == NULL)
+			return NULL;
+		if (s->hash == hash && match(s->item, key))
+			return s;
+	}
+}
+
+void *
+dhcpcd_hmap_find(const DHCPCD_HMAP *map, uint32_t hash,
+    bool (*match)(const void *, const void *), const void *key)
+{
+	DHCPCD_HMAP_SLOT *s;
+
+	assert(map);
+	assert(match);
+	s = dhcpcd_hmap_slot(map, hash, match, key);
+	return s == NULL ? NULL : s->item;
+}
+
+void *
+dhcpcd_hmap_del(DHCPCD_HMAP *map, uint32_t hash,
+    bool (*match)(const void *, const void *), const void *key)
+{
+	DHCPCD_HMAP_SLOT *s;
+	size_t mask, hole, pos, home;
+	void *item;
+
+	assert(map);
+	assert(match);
+	s = dhcpcd_hmap_slot(map, hash, match, key);
+	if (s == NULL)
+		return NULL;
+	item = s->item;
+	map->len--;
+
+	/* Shift back any following entries which would
+	 * no longer be found past the hole. */
+	mask = map->size - 1;
+	hole = (size_t)(s - map->slots);
+	for (pos = (hole + 1) & mask;
+	    map->slots[pos].item != NULL;
+	    pos = (pos + 1) & mask)
+	{
+		home = map->slots[pos].hash & mask;
+		if (((pos - home) & mask) >= ((pos - hole) & mask)) {
+			map->slots[hole] = map->slots[pos];
+			hole = pos;
+		}
+	}
+	map->slots[hole].item = NULL;
+	return item;
+}
+
+void
+dhcpcd_hmap_clear(DHCPCD_HMAP *map)
+{
+
+	assert(map);
+	free(map->slots);
+	map->slots = NULL;
+	map->size = map->len = 0;
+}
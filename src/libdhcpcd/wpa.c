@@ -26,6 +26,9 @@
 
 #define _GNU_SOURCE /* for asprintf */
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -33,9 +36,11 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <pwd.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,6 +58,12 @@
 #define CLAMP(x, low, high) \
 	(((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 
+#define UNUSED(x)	(void)(x)
+
+#ifndef __arraycount
+#define __arraycount(__x)	(sizeof(__x) / sizeof(__x[0]))
+#endif
+
 static int
 wpa_open(const char *ifname, char **path)
 {
@@ -145,13 +156,499 @@ wpa_cmd(int fd, const char *cmd, char *buffer, size_t len)
 	return bytes;
 }
 
+/* wpa_supplicant answers each command on the command socket with one
+ * datagram, in the order the commands arrived. So we can have several
+ * in flight and match the replies from the head of the queue.
+ * Linux only queues 10 datagrams on a socket by default. */
+#define	WPA_CMD_INFLIGHT	8
+
+/* wpa_supplicant replies are at most 4k */
+#define	WPA_REPLY_SIZE		8192
+
+static void
+wpa_cmd_done(DHCPCD_WPA *wpa, int error, const char *reply, size_t len)
+{
+	DHCPCD_WPA_CMD *c;
+
+	c = wpa->cmd_head;
+	wpa->cmd_head = c->next;
+	if (wpa->cmd_head == NULL)
+		wpa->cmd_tail = &wpa->cmd_head;
+	if (wpa->cmd_unsent == c)
+		wpa->cmd_unsent = c->next;
+	if (c->cb)
+		c->cb(wpa, error, reply, len, c->cb_context);
+	free(c->cmd);
+	free(c);
+}
+
+/* Fail every queued command.
+ * The callbacks may queue more, so take the queue first. */
+static void
+wpa_cmd_flush(DHCPCD_WPA *wpa, int error)
+{
+	DHCPCD_WPA_CMD *c, *n;
+
+	c = wpa->cmd_head;
+	wpa->cmd_head = wpa->cmd_unsent = NULL;
+	wpa->cmd_tail = &wpa->cmd_head;
+	wpa->cmd_inflight = 0;
+	for (; c != NULL; c = n) {
+		n = c->next;
+		if (c->cb)
+			c->cb(wpa, error, NULL, 0, c->cb_context);
+		free(c->cmd);
+		free(c);
+	}
+}
+
+/* wpa_supplicant may still answer a command which timed out,
+ * so we can no longer tell which reply is which.
+ * Start again on a new socket, keeping the descriptor the
+ * frontend watches, and fail everything queued on the old one. */
+static void
+wpa_cmd_expire(DHCPCD_WPA *wpa)
+{
+	char *path;
+	int fd;
+
+	if ((fd = wpa_open(wpa->ifname, &path)) == -1)
+		goto err;
+	if (dup2(fd, wpa->command_fd) == -1 ||
+	    fcntl(wpa->command_fd, F_SETFD, FD_CLOEXEC) == -1)
+	{
+		close(fd);
+		unlink(path);
+		free(path);
+		goto err;
+	}
+	close(fd);
+	unlink(wpa->command_path);
+	free(wpa->command_path);
+	wpa->command_path = path;
+	wpa_cmd_flush(wpa, ETIMEDOUT);
+	return;
+
+err:
+	dhcpcd_wpa_close(wpa);
+}
+
+/* Milliseconds until the oldest command times out,
+ * -1 if none is waiting. */
+static int
+wpa_cmd_timeout(const DHCPCD_WPA *wpa, uint64_t now)
+{
+	uint64_t expires;
+
+	if (wpa->cmd_head == NULL || wpa->cmd_head == wpa->cmd_unsent)
+		return -1;
+	expires = wpa->cmd_head->sent + DHCPCD_WPA_TIMEOUT;
+	if (expires <= now)
+		return 0;
+	return (int)(expires - now);
+}
+
+static int
+wpa_cmd_write(DHCPCD_WPA *wpa, DHCPCD_WPA_CMD *c)
+{
+
+	if (write(wpa->command_fd, c->cmd, strlen(c->cmd)) == -1)
+		return -1;
+	c->sent = dhcpcd_now();
+	wpa->cmd_inflight++;
+	return 0;
+}
+
+/* Send what we have room for. */
+static void
+wpa_cmd_send(DHCPCD_WPA *wpa)
+{
+	DHCPCD_WPA_CMD *c;
+
+	while ((c = wpa->cmd_unsent) != NULL &&
+	    wpa->cmd_inflight < WPA_CMD_INFLIGHT)
+	{
+		if (wpa_cmd_write(wpa, c) == -1) {
+			/* We'll try again when a reply frees up space */
+			if (errno == EAGAIN && wpa->cmd_inflight != 0)
+				break;
+			dhcpcd_wpa_close(wpa);
+			return;
+		}
+		wpa->cmd_unsent = c->next;
+	}
+}
+
+int
+dhcpcd_wpa_command_async(DHCPCD_WPA *wpa, const char *cmd,
+    void (*cb)(DHCPCD_WPA *, int, const char *, size_t, void *),
+    void *context)
+{
+	DHCPCD_WPA_CMD *c;
+
+	assert(wpa);
+	assert(cmd);
+	if (wpa->command_fd == -1) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	c = malloc(sizeof(*c));
+	if (c == NULL)
+		return -1;
+	if ((c->cmd = strdup(cmd)) == NULL) {
+		free(c);
+		return -1;
+	}
+	c->next = NULL;
+	c->sent = 0;
+	c->cb = cb;
+	c->cb_context = context;
+
+	/* Report an error sending straight away to the caller */
+	if (wpa->cmd_unsent == NULL && wpa->cmd_inflight < WPA_CMD_INFLIGHT &&
+	    wpa_cmd_write(wpa, c) == -1 &&
+	    (errno != EAGAIN || wpa->cmd_inflight == 0))
+	{
+		int error = errno;
+
+		free(c->cmd);
+		free(c);
+		/* wpa_supplicant has gone away */
+		if (error == ECONNREFUSED || error == ENOENT)
+			dhcpcd_wpa_close(wpa);
+		errno = error;
+		return -1;
+	}
+	if (c->sent == 0 && wpa->cmd_unsent == NULL)
+		wpa->cmd_unsent = c;
+	*wpa->cmd_tail = c;
+	wpa->cmd_tail = &c->next;
+	return 0;
+}
+
+int
+dhcpcd_wpa_get_command_fd(DHCPCD_WPA *wpa)
+{
+
+	assert(wpa);
+	return wpa->command_fd;
+}
+
+size_t
+dhcpcd_wpa_command_pending(const DHCPCD_WPA *wpa)
+{
+	const DHCPCD_WPA_CMD *c;
+	size_t n;
+
+	assert(wpa);
+	n = 0;
+	for (c = wpa->cmd_head; c; c = c->next)
+		n++;
+	return n;
+}
+
+/* Call when the command socket is readable. */
+void
+dhcpcd_wpa_command_dispatch(DHCPCD_WPA *wpa)
+{
+	ssize_t bytes;
+
+	assert(wpa);
+	if (wpa->command_fd == -1)
+		return;
+	if (wpa->cmd_reply == NULL &&
+	    (wpa->cmd_reply = malloc(WPA_REPLY_SIZE)) == NULL)
+		return;
+
+	for (;;) {
+		bytes = recv(wpa->command_fd, wpa->cmd_reply,
+		    WPA_REPLY_SIZE - 1, 0);
+		if (bytes == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			dhcpcd_wpa_close(wpa);
+			return;
+		}
+		wpa->ping_due = dhcpcd_now() + DHCPCD_WPA_PING;
+		wpa->cmd_reply[bytes] = '\0';
+		if (wpa->cmd_head == NULL || wpa->cmd_head == wpa->cmd_unsent)
+			continue;
+		wpa->cmd_inflight--;
+		wpa_cmd_done(wpa, 0, wpa->cmd_reply, (size_t)bytes);
+		/* The callback may have closed us */
+		if (wpa->command_fd == -1)
+			return;
+	}
+	wpa_cmd_send(wpa);
+}
+
+/* Scan often while looking for a network, just after roaming or
+ * while the menu is open. Otherwise back off, but not so far while
+ * the signal from our BSS wanders as we may want to roam. */
+#define	WPA_SCAN_VARIANCE	100	/* strength, percent squared */
+#define	WPA_SCAN_UNSTABLE	(DHCPCD_WPA_SCAN_LONG / 4)
+
+static DHCPCD_WI_HIST *dhcpcd_wi_hist_find(DHCPCD_CONNECTION *,
+    const char *, const char *);
+
+static bool
+dhcpcd_wpa_signal_stable(DHCPCD_WPA *wpa)
+{
+	DHCPCD_WI_HIST *h;
+	int n, sum, sumsq;
+	size_t i;
+
+	h = dhcpcd_wi_hist_find(wpa->con, wpa->ifname, wpa->bssid);
+	if (h == NULL || h->len < 2)
+		return true;
+	sum = sumsq = 0;
+	for (i = 0; i < h->len; i++) {
+		sum += h->samples[i].strength;
+		sumsq += h->samples[i].strength * h->samples[i].strength;
+	}
+	n = (int)h->len;
+	return (sumsq - sum * sum / n) / n <= WPA_SCAN_VARIANCE;
+}
+
+static unsigned int
+dhcpcd_wpa_scan_interval(DHCPCD_WPA *wpa, uint64_t now)
+{
+	DHCPCD_IF *i;
+	unsigned int max;
+
+	i = dhcpcd_wpa_if(wpa);
+	if (wpa->menu_open || i == NULL || !i->up || wpa->bssid[0] == '\0' ||
+	    now < wpa->roamed + DHCPCD_WPA_SCAN_LONG)
+		return DHCPCD_WPA_SCAN_SHORT;
+	if (dhcpcd_wpa_signal_stable(wpa))
+		max = DHCPCD_WPA_SCAN_MAX;
+	else
+		max = WPA_SCAN_UNSTABLE;
+	return CLAMP(wpa->scan_interval * 2, DHCPCD_WPA_SCAN_SHORT, max);
+}
+
+static void
+dhcpcd_wpa_scan_schedule(DHCPCD_WPA *wpa, uint64_t now)
+{
+
+	wpa->scan_interval = dhcpcd_wpa_scan_interval(wpa, now);
+	wpa->scan_due = now + wpa->scan_interval;
+}
+
+/* Milliseconds until the oldest command times out, we should scan
+ * or we should check wpa_supplicant is still there, -1 if it's not open.
+ * We normally find out it has gone from CTRL-EVENT-TERMINATING,
+ * an error sending to it or its socket being removed. */
+int
+dhcpcd_wpa_get_timeout(DHCPCD_WPA *wpa)
+{
+	uint64_t now, expires;
+	int timeout;
+
+	assert(wpa);
+	if (wpa->command_fd == -1)
+		return -1;
+	now = dhcpcd_now();
+	expires = wpa->ping_due;
+	if (wpa->scan_due < expires)
+		expires = wpa->scan_due;
+	if (expires <= now)
+		return 0;
+	timeout = wpa_cmd_timeout(wpa, now);
+	if (timeout != -1 && (uint64_t)timeout < expires - now)
+		return timeout;
+	return (int)(expires - now);
+}
+
+void
+dhcpcd_wpa_dispatch_timeout(DHCPCD_WPA *wpa)
+{
+	uint64_t now;
+	DHCPCD_IF *i;
+
+	assert(wpa);
+	now = dhcpcd_now();
+	if (wpa_cmd_timeout(wpa, now) == 0) {
+		wpa_cmd_expire(wpa);
+		if (wpa->command_fd == -1)
+			return;
+	}
+	wpa_cmd_send(wpa);
+	if (wpa->command_fd == -1)
+		return;
+
+	if (wpa->scan_due <= now) {
+		i = dhcpcd_wpa_if(wpa);
+		if (i == NULL || !i->up || dhcpcd_wpa_can_background_scan(wpa))
+			dhcpcd_wpa_scan(wpa);
+		/* CTRL-EVENT-SCAN-RESULTS will pick the next interval */
+		wpa->scan_due = now + wpa->scan_interval;
+	}
+	if (wpa->ping_due > now)
+		return;
+
+	/* It's been quiet, so make sure it's still there */
+	wpa->ping_due = now + DHCPCD_WPA_PING;
+	if (dhcpcd_wpa_ping_async(wpa) == -1)
+		dhcpcd_wpa_close(wpa);
+}
+
+struct wpa_cmd_wait {
+	bool done;
+	int error;
+	char *buffer;
+	size_t len;
+	ssize_t bytes;
+};
+
+static void
+wpa_cmd_wait_cb(DHCPCD_WPA *wpa, int error, const char *reply, size_t len,
+    void *arg)
+{
+	struct wpa_cmd_wait *w = arg;
+
+	UNUSED(wpa);
+	w->done = true;
+	w->error = error;
+	if (error != 0 || w->buffer == NULL || w->len == 0)
+		return;
+	if (len > w->len - 1)
+		len = w->len - 1;
+	memcpy(w->buffer, reply, len);
+	w->buffer[len] = '\0';
+	w->bytes = (ssize_t)len;
+}
+
+/* Wait for the next reply or timeout on the command socket.
+ * Scanning and pinging are left to the frontend's own loop. */
+static void
+wpa_cmd_poll(DHCPCD_WPA *wpa)
+{
+	struct pollfd pfd;
+
+	pfd.fd = wpa->command_fd;
+	pfd.events = POLLIN;
+	switch (poll(&pfd, 1, wpa_cmd_timeout(wpa, dhcpcd_now()))) {
+	case -1:
+		if (errno != EINTR)
+			dhcpcd_wpa_close(wpa);
+		break;
+	case 0:
+		wpa_cmd_expire(wpa);
+		break;
+	default:
+		dhcpcd_wpa_command_dispatch(wpa);
+		break;
+	}
+}
+
+/* Queue the command and dispatch the command socket until
+ * it's answered or times out. */
+static ssize_t
+wpa_cmd_wait(DHCPCD_WPA *wpa, const char *cmd, char *buffer, size_t len)
+{
+	struct wpa_cmd_wait w = { false, 0, buffer, len, 0 };
+
+	if (buffer && len != 0)
+		*buffer = '\0';
+	if (dhcpcd_wpa_command_async(wpa, cmd, wpa_cmd_wait_cb, &w) == -1)
+		return -1;
+	while (!w.done)
+		wpa_cmd_poll(wpa);
+	if (w.error != 0) {
+		errno = w.error;
+		return -1;
+	}
+	return w.bytes;
+}
+
+/* A set of commands pipelined to wpa_supplicant.
+ * Replies come back in order, so the result is that of
+ * the first command to fail. */
+struct wpa_txn {
+	size_t pending;
+	int retval;
+};
+
+struct wpa_txn_cmd {
+	struct wpa_txn *txn;
+	int err;
+	char *buffer;
+	size_t len;
+};
+
+static void
+wpa_txn_cb(DHCPCD_WPA *wpa, int error, const char *reply, size_t len,
+    void *arg)
+{
+	struct wpa_txn_cmd *c = arg;
+	struct wpa_txn *txn = c->txn;
+
+	UNUSED(wpa);
+	txn->pending--;
+	if (error == 0) {
+		if (c->buffer == NULL) {
+			if (strcmp(reply, "OK\n") != 0)
+				error = EINVAL;
+		} else if (strncmp(reply, "FAIL", 4) == 0)
+			error = EINVAL;
+		else {
+			if (len > c->len - 1)
+				len = c->len - 1;
+			memcpy(c->buffer, reply, len);
+			c->buffer[len] = '\0';
+		}
+	}
+	if (error != 0 && txn->retval == DHCPCD_WPA_SUCCESS)
+		txn->retval = c->err;
+	free(c);
+}
+
+/* Queue cmd, reporting err if it fails.
+ * If buffer is NULL the reply must be OK, otherwise it's
+ * stored in buffer. */
+static bool
+wpa_txn_add(DHCPCD_WPA *wpa, struct wpa_txn *txn, int err,
+    const char *cmd, char *buffer, size_t len)
+{
+	struct wpa_txn_cmd *c;
+
+	if ((c = malloc(sizeof(*c))) == NULL)
+		goto fail;
+	c->txn = txn;
+	c->err = err;
+	c->buffer = buffer;
+	c->len = len;
+	if (dhcpcd_wpa_command_async(wpa, cmd, wpa_txn_cb, c) == -1) {
+		free(c);
+		goto fail;
+	}
+	txn->pending++;
+	return true;
+
+fail:
+	if (txn->retval == DHCPCD_WPA_SUCCESS)
+		txn->retval = err;
+	return false;
+}
+
+static int
+wpa_txn_wait(DHCPCD_WPA *wpa, struct wpa_txn *txn)
+{
+
+	while (txn->pending != 0)
+		wpa_cmd_poll(wpa);
+	return txn->retval;
+}
+
 bool
 dhcpcd_wpa_command(DHCPCD_WPA *wpa, const char *cmd)
 {
 	char buf[10];
 	ssize_t bytes;
 
-	bytes = wpa_cmd(wpa->command_fd, cmd, buf, sizeof(buf));
+	bytes = wpa_cmd_wait(wpa, cmd, buf, sizeof(buf));
 	return (bytes == -1 || bytes == 0 ||
 	    strcmp(buf, "OK\n")) ? false : true;
 }
@@ -175,11 +672,32 @@ dhcpcd_wpa_ping(DHCPCD_WPA *wpa)
 	char buf[10];
 	ssize_t bytes;
 
-	bytes = wpa_cmd(wpa->command_fd, "PING", buf, sizeof(buf));
+	bytes = wpa_cmd_wait(wpa, "PING", buf, sizeof(buf));
 	return (bytes == -1 || bytes == 0 ||
 	    strcmp(buf, "PONG\n")) ? false : true;
 }
 
+static void
+dhcpcd_wpa_ping_cb(DHCPCD_WPA *wpa, int error, const char *reply,
+    size_t len, void *arg)
+{
+
+	UNUSED(len);
+	UNUSED(arg);
+	if (error == ECONNRESET)
+		return;
+	if (error != 0 || strcmp(reply, "PONG\n") != 0)
+		dhcpcd_wpa_close(wpa);
+}
+
+/* Like dhcpcd_wpa_ping, but closes wpa if there is no answer. */
+int
+dhcpcd_wpa_ping_async(DHCPCD_WPA *wpa)
+{
+
+	return dhcpcd_wpa_command_async(wpa, "PING", dhcpcd_wpa_ping_cb, NULL);
+}
+
 bool
 dhcpcd_wpa_command_arg(DHCPCD_WPA *wpa, const char *cmd, const char *arg)
 {
@@ -213,7 +731,6 @@ dhcpcd_attach_detach(DHCPCD_WPA *wpa, bool attach)
 	return true;
 }
 
-#define UNUSED(x)	(void)(x)
 bool
 dhcpcd_wpa_can_background_scan(DHCPCD_WPA *wpa)
 {
@@ -226,11 +743,26 @@ dhcpcd_wpa_can_background_scan(DHCPCD_WPA *wpa)
 #endif
 }
 
+/* Scanning takes a while and we get CTRL-EVENT-SCAN-RESULTS when
+ * it's done, so don't wait for the reply. */
 bool
 dhcpcd_wpa_scan(DHCPCD_WPA *wpa)
 {
 
-	return dhcpcd_wpa_command(wpa, "SCAN");
+	return dhcpcd_wpa_command_async(wpa, "SCAN", NULL, NULL) == 0;
+}
+
+/* The user is looking at the results, so keep them fresh. */
+void
+dhcpcd_wpa_set_menu_open(DHCPCD_WPA *wpa, bool open)
+{
+
+	assert(wpa);
+	if (wpa->menu_open == open)
+		return;
+	wpa->menu_open = open;
+	if (open && wpa->command_fd != -1)
+		dhcpcd_wpa_scan_schedule(wpa, dhcpcd_now());
 }
 
 bool
@@ -243,16 +775,20 @@ dhcpcd_wi_associated(DHCPCD_IF *i, DHCPCD_WI_SCAN *scan)
 	return (i->up && i->ssid && strcmp(i->ssid, scan->ssid) == 0);
 }
 
+const DHCPCD_WPA_SCAN_STATS *
+dhcpcd_wpa_scan_stats(const DHCPCD_WPA *wpa)
+{
+
+	assert(wpa);
+	return &wpa->scan_stats;
+}
+
 void
 dhcpcd_wi_scans_free(DHCPCD_WI_SCAN *wis)
 {
-	DHCPCD_WI_SCAN *n;
 
-	while (wis) {
-		n = wis->next;
-		free(wis);
-		wis = n;
-	}
+	/* dhcpcd_wi_scans returns a single array */
+	free(wis);
 }
 
 static int
@@ -294,8 +830,9 @@ dhcpcd_wpa_hex2byte(const char *src)
 	return (h << 4) | l;
 }
 
+/* Decodes into at most dlen bytes without a terminating NUL */
 static ssize_t
-dhcpcd_wpa_decode_ssid(char *dst, size_t dlen, const char *src)
+dhcpcd_wpa_decode_ssid_raw(char *dst, size_t dlen, const char *src)
 {
 	const char *start;
 	char c, esc;
@@ -305,7 +842,7 @@ dhcpcd_wpa_decode_ssid(char *dst, size_t dlen, const char *src)
 	for (;;) {
 		if (*src == '\0')
 			break;
-		if (--dlen == 0) {
+		if (dlen-- == 0) {
 			errno = ENOSPC;
 			return -1;
 		}
@@ -341,127 +878,857 @@ dhcpcd_wpa_decode_ssid(char *dst, size_t dlen, const char *src)
 		default: *dst++ = c; break;
 		}
 	}
-	if (dlen == 0) {
-		errno = ENOSPC;
-		return -1;
-	}
-	*dst = '\0';
 	return dst - start;
 }
 
-static DHCPCD_WI_SCAN *
-dhcpcd_wpa_scans_read(DHCPCD_WPA *wpa)
+static ssize_t
+dhcpcd_wpa_decode_ssid(char *dst, size_t dlen, const char *src)
 {
-	size_t i;
-	ssize_t bytes, dl;
-	DHCPCD_WI_SCAN *wis, *w, *l;
-	char *s, *p, buf[32];
-	char wssid[sizeof(w->ssid)];
-	const char *proto;
-
-	if (!dhcpcd_realloc(wpa->con, 2048))
-		return NULL;
-	wis = NULL;
-	for (i = 0; i < 1000; i++) {
-		snprintf(buf, sizeof(buf), "BSS %zu", i);
-		bytes = wpa_cmd(wpa->command_fd, buf,
-		    wpa->con->buf, wpa->con->buflen);
-		if (bytes == 0 || bytes == -1 ||
-		    strncmp(wpa->con->buf, "FAIL", 4) == 0)
-			break;
-		p = wpa->con->buf;
-		w = calloc(1, sizeof(*w));
-		if (w == NULL)
-			break;
-		dl = 0;
-		wssid[0] = '\0';
-		while ((s = strsep(&p, "\n"))) {
-			if (*s == '\0')
-				continue;
-			if (strncmp(s, "bssid=", 6) == 0)
-				strlcpy(w->bssid, s + 6, sizeof(w->bssid));
-			else if (strncmp(s, "freq=", 5) == 0)
-				dhcpcd_strtoi(&w->frequency, s + 5);
-//			else if (strncmp(s, "beacon_int=", 11) == 0)
-//				;
-			else if (strncmp(s, "qual=", 5) == 0)
-				dhcpcd_strtoi(&w->quality.value, s + 5);
-			else if (strncmp(s, "noise=", 6) == 0)
-				dhcpcd_strtoi(&w->noise.value, s + 6);
-			else if (strncmp(s, "level=", 6) == 0)
-				dhcpcd_strtoi(&w->level.value, s + 6);
-			else if (strncmp(s, "flags=", 6) == 0)
-				strlcpy(w->wpa_flags, s + 6,
-				    sizeof(w->wpa_flags));
-			else if (strncmp(s, "ssid=", 5) == 0) {
-				/* Decode it from \xNN to \NNN
-				 * so we're consistent */
-				dl = dhcpcd_wpa_decode_ssid(wssid,
-				    sizeof(wssid), s + 5);
-				if (dl == -1)
-					break;
-				dl = dhcpcd_encode_string_escape(w->ssid,
-				    sizeof(w->ssid), wssid, (size_t)dl);
-				if (dl == -1)
-					break;
-			}
-		}
-		if (dl == -1) {
-			free(w);
-			break;
-		}
+	ssize_t dl;
 
-		if (wis == NULL)
-			wis = w;
-		else
-			l->next = w;
-		l = w;
+	if (dlen == 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if ((dl = dhcpcd_wpa_decode_ssid_raw(dst, dlen - 1, src)) == -1)
+		return -1;
+	dst[dl] = '\0';
+	return dl;
+}
 
-		if ((proto = strstr(w->wpa_flags, "[WPA-")) ||
-		    (proto = strstr(w->wpa_flags, "[WPA2-")) ||
-		    (proto = strstr(w->wpa_flags, "[RSN-")))
-		{
-			const char *endp, *psk;
+/* Fields we parse from a BSS reply */
+#define	WPA_BSS_MASK_ID		0x00001
+#define	WPA_BSS_MASK_BSSID	0x00002
+#define	WPA_BSS_MASK_FREQ	0x00004
+#define	WPA_BSS_MASK_QUAL	0x00020
+#define	WPA_BSS_MASK_NOISE	0x00040
+#define	WPA_BSS_MASK_LEVEL	0x00080
+#define	WPA_BSS_MASK_AGE	0x00200
+#define	WPA_BSS_MASK_FLAGS	0x00800
+#define	WPA_BSS_MASK_SSID	0x01000
+#define	WPA_BSS_MASK_DELIM	0x20000
+#define	WPA_BSS_MASK							\
+	(WPA_BSS_MASK_ID | WPA_BSS_MASK_BSSID | WPA_BSS_MASK_FREQ |	\
+	WPA_BSS_MASK_QUAL | WPA_BSS_MASK_NOISE | WPA_BSS_MASK_LEVEL |	\
+	WPA_BSS_MASK_AGE | WPA_BSS_MASK_FLAGS | WPA_BSS_MASK_SSID |	\
+	WPA_BSS_MASK_DELIM)
+/* Just the fields which change between scans */
+#define	WPA_BSS_MASK_SIGNAL						\
+	(WPA_BSS_MASK_ID | WPA_BSS_MASK_QUAL | WPA_BSS_MASK_NOISE |	\
+	WPA_BSS_MASK_LEVEL | WPA_BSS_MASK_AGE | WPA_BSS_MASK_DELIM)
+
+/* wpa_supplicant expires a BSS after 180 seconds by default */
+#define	WPA_BSS_EXPIRE		180
 
-			w->flags = WSF_WPA | WSF_SECURE;
-			endp = strchr(proto, ']');
-			if ((psk = strstr(proto, "-PSK]")) ||
-			    (psk = strstr(proto, "-PSK-")) ||
-			    (psk = strstr(proto, "-PSK+")))
-			{
-				if (psk < endp)
-					w->flags |= WSF_PSK;
-			}
-		}
-		if (strstr(w->wpa_flags, "[WEP]"))
-			w->flags = WSF_WEP | WSF_PSK | WSF_SECURE;
+static int
+dhcpcd_wpa_scan_strength(int level)
+{
+	int strength;
 
-		w->strength.value = w->level.value;
+	strength = level;
 #ifdef __linux__
-		if (w->strength.value > 110 && w->strength.value < 256)
-			/* Convert WEXT level to dBm */
-			w->strength.value -= 256;
+	if (strength > 110 && strength < 256)
+		/* Convert WEXT level to dBm */
+		strength -= 256;
 #endif
 
-		if (w->strength.value < 0) {
-			/* Assume dBm */
-			w->strength.value =
-			    abs(CLAMP(w->strength.value, -100, -40) + 40);
-			w->strength.value =
-			    100 - ((100 * w->strength.value) / 60);
-		} else {
-			/* Assume quality percentage */
-			w->strength.value = CLAMP(w->strength.value, 0, 100);
-		}
+	if (strength < 0) {
+		/* Assume dBm */
+		strength = abs(CLAMP(strength, -100, -40) + 40);
+		strength = 100 - ((100 * strength) / 60);
+	} else {
+		/* Assume quality percentage */
+		strength = CLAMP(strength, 0, 100);
 	}
-	return wis;
+	return strength;
 }
 
-int
-dhcpcd_wi_scan_compare(DHCPCD_WI_SCAN *a, DHCPCD_WI_SCAN *b)
-{
-	int cmp;
-
+/*
+ * The flags= text is a list of [tokens] such as
+ * [WPA-PSK-TKIP][WPA2-PSK-CCMP+TKIP-preauth][WPS][ESS]
+ * The tokens we know are kept as bits to sort and filter on,
+ * but the text is shown as wpa_supplicant gave it so nothing
+ * we don't know is lost.
+ * Key management and cipher names can contain - so we match
+ * the longest name we know which ends at a delimiter.
+ */
+static const char * const wpa_ie_protos[] = {
+	"WPA", "WPA2", "RSN", "OSEN",
+};
+static const char * const wpa_ie_akms[] = {
+	"EAP", "PSK", "None", "FT/EAP", "FT/PSK", "EAP-SHA256", "PSK-SHA256",
+	"SAE", "FT/SAE", "OWE", "DPP", "EAP-SUITE-B", "EAP-SUITE-B-192",
+	"FILS-SHA256", "FILS-SHA384", "FT-FILS-SHA256", "FT-FILS-SHA384",
+	"SAE-EXT-KEY", "FT/SAE-EXT-KEY", "EAP-SHA384", "FT/EAP-SHA384",
+};
+static const char * const wpa_ie_ciphers[] = {
+	"CCMP-256", "GCMP-256", "CCMP", "GCMP", "TKIP", "NONE",
+};
+static const struct wpa_bss_flag {
+	const char *name;
+	unsigned int flag;
+} wpa_bss_flags[] = {
+	{ "WPS",	WBF_WPS },
+	{ "WEP",	WBF_WEP },
+	{ "MESH",	WBF_MESH },
+	{ "ESS",	WBF_ESS },
+	{ "IBSS",	WBF_IBSS },
+	{ "P2P",	WBF_P2P },
+	{ "HS20",	WBF_HS20 },
+};
+
+#define	WIE_AKM(i)		(1U << (i))
+#define	WIE_AKM_MASK		0x001fffffU
+#define	WIE_CIPHER(i)		(1U << ((i) + 21))
+#define	WIE_CIPHER_MASK		0x07e00000U
+#define	WIE_PROTO(i)		((unsigned int)((i) + 1) << 27)
+#define	WIE_PREAUTH		0x80000000U
+#define	WIE_AKM_PSK							\
+	(WIE_AKM(1) | WIE_AKM(4) | WIE_AKM(6))
+
+static int
+wpa_ie_match(const char *p, const char * const *names, size_t n,
+    size_t *lenp)
+{
+	size_t i, len;
+	int best;
+
+	best = -1;
+	*lenp = 0;
+	for (i = 0; i < n; i++) {
+		if (names[i][0] != *p)
+			continue;
+		len = strlen(names[i]);
+		if (len > *lenp && strncmp(p, names[i], len) == 0 &&
+		    (p[len] == '+' || p[len] == '-' || p[len] == ']'))
+		{
+			best = (int)i;
+			*lenp = len;
+		}
+	}
+	return best;
+}
+
+/* PROTO-AKM[+AKM]-CIPHER[+CIPHER][-preauth]
+ * endp is set to where we stopped so the caller can carry on from there. */
+static unsigned int
+wpa_ie_parse(const char *p, const char **endp)
+{
+	unsigned int ie;
+	size_t len;
+	int i;
+
+	*endp = p;
+	if ((i = wpa_ie_match(p, wpa_ie_protos,
+	    __arraycount(wpa_ie_protos), &len)) == -1 || p[len] != '-')
+		return 0;
+	ie = WIE_PROTO(i);
+	p += len + 1;
+	while ((i = wpa_ie_match(p, wpa_ie_akms,
+	    __arraycount(wpa_ie_akms), &len)) != -1)
+	{
+		ie |= WIE_AKM(i);
+		p += len;
+		if (*p != '+')
+			break;
+		p++;
+	}
+	*endp = p;
+	if (*p++ != '-')
+		return ie;
+	while ((i = wpa_ie_match(p, wpa_ie_ciphers,
+	    __arraycount(wpa_ie_ciphers), &len)) != -1)
+	{
+		ie |= WIE_CIPHER(i);
+		p += len;
+		if (*p != '+')
+			break;
+		p++;
+	}
+	*endp = p;
+	if (strncmp(p, "-preauth]", 9) == 0) {
+		ie |= WIE_PREAUTH;
+		*endp = p + 8;
+	}
+	return ie;
+}
+
+/* One sweep over the tokens, the IE parser carrying on to the ] */
+static void
+wpa_bss_flags_parse(DHCPCD_WPA_BSS *b, const char *p)
+{
+	const char *e;
+	size_t i, nie, len;
+	unsigned int ie;
+
+	b->flags = 0;
+	memset(b->ie, 0, sizeof(b->ie));
+	nie = 0;
+	while ((p = strchr(p, '[')) != NULL) {
+		p++;
+		ie = wpa_ie_parse(p, &e);
+		if ((e = strchr(e, ']')) == NULL)
+			break;
+		if (ie != 0) {
+			if (nie < __arraycount(b->ie))
+				b->ie[nie++] = ie;
+			p = e + 1;
+			continue;
+		}
+		len = (size_t)(e - p);
+		for (i = 0; i < __arraycount(wpa_bss_flags); i++) {
+			if (strlen(wpa_bss_flags[i].name) == len &&
+			    strncmp(p, wpa_bss_flags[i].name, len) == 0)
+			{
+				b->flags |= wpa_bss_flags[i].flag;
+				break;
+			}
+		}
+		p = e + 1;
+	}
+}
+
+static unsigned int
+wpa_bss_secflags(const DHCPCD_WPA_BSS *b)
+{
+	unsigned int flags;
+	size_t i;
+
+	if (b->flags & WBF_WEP)
+		return WSF_WEP | WSF_PSK | WSF_SECURE;
+	flags = 0;
+	for (i = 0; i < __arraycount(b->ie); i++) {
+		if (b->ie[i] == 0)
+			continue;
+		flags |= WSF_WPA | WSF_SECURE;
+		if (b->ie[i] & WIE_AKM_PSK)
+			flags |= WSF_PSK;
+	}
+	return flags;
+}
+
+static int
+wpa_bssid_aton(uint8_t *bssid, const char *s)
+{
+	size_t i;
+	int h, l;
+
+	for (i = 0; i < WPA_BSSID_LEN; i++) {
+		if ((h = dhcpcd_wpa_hex2num(*s++)) == -1 ||
+		    (l = dhcpcd_wpa_hex2num(*s++)) == -1)
+			return -1;
+		bssid[i] = (uint8_t)((h << 4) | l);
+		if (*s != (i == WPA_BSSID_LEN - 1 ? '\0' : ':'))
+			return -1;
+		s++;
+	}
+	return 0;
+}
+
+static void
+wpa_bssid_ntoa(char *buf, size_t len, const uint8_t *bssid)
+{
+
+	snprintf(buf, len, "%02x:%02x:%02x:%02x:%02x:%02x",
+	    bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+}
+
+/*
+ * BSS replies are key=value lines. The keys we want are found with
+ * a perfect hash of their first and last characters and length,
+ * so each line costs one lookup and one compare.
+ * The hash must be checked against every name here when one is added.
+ */
+#define	WBT_INT			1
+#define	WBT_UINT		2
+#define	WBT_BSSID		3
+#define	WBT_FLAGS		4
+#define	WBT_SSID		5
+#define	WPA_BSS_FIELD_HASH(k, l)					\
+	(((size_t)(unsigned char)(k)[0] * 2 +				\
+	(unsigned char)(k)[(l) - 1] + (l)) & 0xf)
+static const struct wpa_bss_field {
+	const char *name;
+	size_t len;
+	int type;
+	size_t offset;
+} wpa_bss_fields[16] = {
+	[1] =	{ "freq",	4, WBT_INT,
+		  offsetof(DHCPCD_WPA_BSS, frequency) },
+	[2] =	{ "qual",	4, WBT_INT,
+		  offsetof(DHCPCD_WPA_BSS, quality) },
+	[4] =	{ "flags",	5, WBT_FLAGS, 0 },
+	[6] =	{ "noise",	5, WBT_INT,
+		  offsetof(DHCPCD_WPA_BSS, noise) },
+	[8] =	{ "id",		2, WBT_UINT,
+		  offsetof(DHCPCD_WPA_BSS, id) },
+	[9] =	{ "level",	5, WBT_INT,
+		  offsetof(DHCPCD_WPA_BSS, level) },
+	[10] =	{ "age",	3, WBT_UINT,
+		  offsetof(DHCPCD_WPA_BSS, age) },
+	[13] =	{ "bssid",	5, WBT_BSSID, 0 },
+	[14] =	{ "ssid",	4, WBT_SSID, 0 },
+};
+
+static bool
+dhcpcd_wpa_flags_match(const void *item, const void *key)
+{
+	const DHCPCD_WPA_FLAGS *f = item;
+
+	return strcmp(f->text, key) == 0;
+}
+
+/* Most BSS share one of a few flags strings, so each is kept once
+ * and counted. */
+static DHCPCD_WPA_FLAGS *
+dhcpcd_wpa_flags_get(DHCPCD_WPA *wpa, const char *text)
+{
+	DHCPCD_WPA_FLAGS *f;
+	uint32_t hash;
+	size_t len;
+
+	len = strlen(text);
+	hash = dhcpcd_hash(DHCPCD_HASH_INIT, text, len);
+	f = dhcpcd_hmap_find(&wpa->flags_map, hash,
+	    dhcpcd_wpa_flags_match, text);
+	if (f == NULL) {
+		if ((f = malloc(sizeof(*f) + len + 1)) == NULL)
+			return NULL;
+		f->refs = 0;
+		f->hash = hash;
+		memcpy(f->text, text, len + 1);
+		if (dhcpcd_hmap_add(&wpa->flags_map, hash, f) == -1) {
+			free(f);
+			return NULL;
+		}
+	}
+	f->refs++;
+	return f;
+}
+
+static void
+dhcpcd_wpa_flags_put(DHCPCD_WPA *wpa, DHCPCD_WPA_FLAGS *f)
+{
+
+	if (f == NULL || --f->refs != 0)
+		return;
+	dhcpcd_hmap_del(&wpa->flags_map, f->hash,
+	    dhcpcd_wpa_flags_match, f->text);
+	free(f);
+}
+
+/* A single pass over the reply, terminating each line in place
+ * and writing values straight into the BSS.
+ * The BSS holds a reference to its flags text which the caller
+ * must put once done with it. */
+static int
+dhcpcd_wpa_scan_parse(DHCPCD_WPA *wpa, DHCPCD_WPA_BSS *b, char *p)
+{
+	const struct wpa_bss_field *f;
+	char *key, *val;
+	size_t klen;
+	ssize_t dl;
+
+	for (key = p; *key != '\0'; key = p) {
+		klen = strcspn(key, "=\n");
+		val = key + klen;
+		p = val + strcspn(val, "\n");
+		if (*p == '\n')
+			*p++ = '\0';
+		if (*val++ != '=' || klen == 0)
+			continue;
+		f = &wpa_bss_fields[WPA_BSS_FIELD_HASH(key, klen)];
+		if (f->len != klen || memcmp(f->name, key, klen) != 0)
+			continue;
+		switch (f->type) {
+		case WBT_INT:
+			dhcpcd_strtoi((int *)(void *)((char *)b + f->offset),
+			    val);
+			break;
+		case WBT_UINT:
+			*(unsigned int *)(void *)((char *)b + f->offset) =
+			    (unsigned int)strtoul(val, NULL, 0);
+			break;
+		case WBT_BSSID:
+			b->bssid_set = wpa_bssid_aton(b->bssid, val) == 0;
+			break;
+		case WBT_FLAGS:
+			wpa_bss_flags_parse(b, val);
+			dhcpcd_wpa_flags_put(wpa, b->text);
+			if ((b->text = dhcpcd_wpa_flags_get(wpa, val)) == NULL)
+				return -1;
+			break;
+		case WBT_SSID:
+			dl = dhcpcd_wpa_decode_ssid_raw((char *)b->ssid,
+			    sizeof(b->ssid), val);
+			if (dl == -1)
+				return -1;
+			b->ssid_len = (uint8_t)dl;
+			break;
+		}
+	}
+
+	b->strength = dhcpcd_wpa_scan_strength(b->level);
+	return 0;
+}
+
+/* The BSS table is kept sorted by the wpa_supplicant BSS id.
+ * New ids are always higher than existing ones, so additions
+ * are appended. */
+static DHCPCD_WPA_BSS *
+dhcpcd_wpa_bss_find(DHCPCD_WPA *wpa, unsigned int id, size_t *pos)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = wpa->bss_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (wpa->bss[mid].id == id) {
+			if (pos)
+				*pos = mid;
+			return &wpa->bss[mid];
+		}
+		if (wpa->bss[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (pos)
+		*pos = lo;
+	return NULL;
+}
+
+static int
+dhcpcd_wpa_bss_add(DHCPCD_WPA *wpa, const DHCPCD_WPA_BSS *nb)
+{
+	DHCPCD_WPA_BSS *b;
+	size_t pos;
+
+	if ((b = dhcpcd_wpa_bss_find(wpa, nb->id, &pos)) == NULL) {
+		if (wpa->bss_len == wpa->bss_size) {
+			size_t nsize;
+
+			nsize = wpa->bss_size == 0 ? 32 : wpa->bss_size * 2;
+			b = realloc(wpa->bss, nsize * sizeof(*b));
+			if (b == NULL)
+				return -1;
+			wpa->bss = b;
+			wpa->bss_size = nsize;
+			wpa->scan_stats.allocs++;
+		}
+		b = &wpa->bss[pos];
+		if (pos != wpa->bss_len)
+			memmove(b + 1, b, sizeof(*b) * (wpa->bss_len - pos));
+		wpa->bss_len++;
+		b->text = NULL;
+	}
+	if (nb->text != NULL)
+		nb->text->refs++;
+	dhcpcd_wpa_flags_put(wpa, b->text);
+	*b = *nb;
+	b->gen = wpa->bss_gen;
+	return 0;
+}
+
+static void
+dhcpcd_wpa_bss_del(DHCPCD_WPA *wpa, size_t pos)
+{
+
+	dhcpcd_wpa_flags_put(wpa, wpa->bss[pos].text);
+	wpa->bss_len--;
+	if (pos != wpa->bss_len)
+		memmove(&wpa->bss[pos], &wpa->bss[pos + 1],
+		    sizeof(*wpa->bss) * (wpa->bss_len - pos));
+}
+
+static void
+dhcpcd_wpa_bss_clear(DHCPCD_WPA *wpa)
+{
+	size_t i;
+
+	for (i = 0; i < wpa->bss_len; i++)
+		dhcpcd_wpa_flags_put(wpa, wpa->bss[i].text);
+	wpa->bss_len = 0;
+}
+
+static void
+dhcpcd_wpa_bss_free(DHCPCD_WPA *wpa)
+{
+
+	dhcpcd_wpa_bss_clear(wpa);
+	dhcpcd_hmap_clear(&wpa->flags_map);
+	free(wpa->bss);
+	wpa->bss = NULL;
+	wpa->bss_len = wpa->bss_size = 0;
+	wpa->bss_loaded = wpa->bss_rescan = false;
+	free(wpa->bss_order);
+	wpa->bss_order = NULL;
+	wpa->bss_order_size = 0;
+}
+
+/* Walk the BSS table of wpa_supplicant in as few round trips as
+ * possible, one command in flight at a time.
+ * Each reply holds as many entries as fit, delimited by ====
+ * with the last entry in the table followed by ####.
+ * If the reply is truncated we carry on from the next id.
+ * Older wpa_supplicant can only give us one BSS at a time. */
+struct wpa_bss_walk {
+	unsigned int mask;
+	unsigned int next;
+	bool index;
+	int (*cb)(DHCPCD_WPA *, const DHCPCD_WPA_BSS *);
+	void (*done)(DHCPCD_WPA *, int);
+};
+
+static void dhcpcd_wpa_bss_walk_cb(DHCPCD_WPA *, int, const char *, size_t,
+    void *);
+
+static int
+dhcpcd_wpa_bss_walk_send(DHCPCD_WPA *wpa, struct wpa_bss_walk *w)
+{
+	char buf[64];
+
+	if (w->index)
+		snprintf(buf, sizeof(buf), "BSS %u", w->next);
+	else if (w->next == 0)
+		snprintf(buf, sizeof(buf), "BSS RANGE=ALL MASK=0x%x",
+		    w->mask);
+	else
+		snprintf(buf, sizeof(buf), "BSS RANGE=%u- MASK=0x%x",
+		    w->next, w->mask);
+	return dhcpcd_wpa_command_async(wpa, buf, dhcpcd_wpa_bss_walk_cb, w);
+}
+
+/* Returns 1 if there is more to fetch, 0 if not or -1 on error. */
+static int
+dhcpcd_wpa_bss_walk_range(DHCPCD_WPA *wpa, struct wpa_bss_walk *w, char *p)
+{
+	DHCPCD_WPA_BSS b;
+	unsigned int n;
+	char *e;
+	bool last;
+	int r;
+
+	/* Older wpa_supplicant parses RANGE=ALL as index 0
+	 * and ignores the mask. */
+	if (w->next == 0 && strstr(p, "\nbeacon_int=")) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	n = 0;
+	last = false;
+	for (; p && *p != '\0'; p = e) {
+		if ((e = strstr(p, "\n====\n")) ||
+		    (e = strstr(p, "\n####\n")))
+		{
+			if (e[1] == '#')
+				last = true;
+			*e = '\0';
+			e += 6;
+		}
+		memset(&b, 0, sizeof(b));
+		b.id = w->next;
+		r = dhcpcd_wpa_scan_parse(wpa, &b, p);
+		if (r == 0)
+			r = w->cb(wpa, &b);
+		dhcpcd_wpa_flags_put(wpa, b.text);
+		if (r == -1)
+			return -1;
+		n++;
+		if (b.id >= w->next)
+			w->next = b.id + 1;
+		if (last)
+			break;
+	}
+	return last || n == 0 ? 0 : 1;
+}
+
+static int
+dhcpcd_wpa_bss_walk_index(DHCPCD_WPA *wpa, struct wpa_bss_walk *w, char *p)
+{
+	DHCPCD_WPA_BSS b;
+	int r;
+
+	memset(&b, 0, sizeof(b));
+	b.id = w->next;
+	r = dhcpcd_wpa_scan_parse(wpa, &b, p);
+	if (r == 0)
+		r = w->cb(wpa, &b);
+	dhcpcd_wpa_flags_put(wpa, b.text);
+	if (r == -1)
+		return -1;
+	return ++w->next < 1000 ? 1 : 0;
+}
+
+static void
+dhcpcd_wpa_bss_walk_cb(DHCPCD_WPA *wpa, int error, const char *reply,
+    size_t len, void *arg)
+{
+	struct wpa_bss_walk *w = arg;
+	int r;
+
+	if (error == 0 && len != 0 && strncmp(reply, "FAIL", 4) != 0) {
+		/* The reply is in our own buffer, so parse it in place */
+		if (w->index)
+			r = dhcpcd_wpa_bss_walk_index(wpa, w, wpa->cmd_reply);
+		else
+			r = dhcpcd_wpa_bss_walk_range(wpa, w, wpa->cmd_reply);
+		if (r == 1 && dhcpcd_wpa_bss_walk_send(wpa, w) == 0)
+			return;
+		if (r != 0)
+			error = errno;
+	}
+	w->done(wpa, error);
+	free(w);
+}
+
+static int
+dhcpcd_wpa_bss_walk(DHCPCD_WPA *wpa, unsigned int mask,
+    int (*cb)(DHCPCD_WPA *, const DHCPCD_WPA_BSS *),
+    void (*done)(DHCPCD_WPA *, int))
+{
+	struct wpa_bss_walk *w;
+
+	if ((w = malloc(sizeof(*w))) == NULL)
+		return -1;
+	w->mask = mask;
+	w->next = 0;
+	w->index = wpa->bss_nomask;
+	w->cb = cb;
+	w->done = done;
+	if (dhcpcd_wpa_bss_walk_send(wpa, w) == -1) {
+		free(w);
+		return -1;
+	}
+	wpa->bss_busy = true;
+	return 0;
+}
+
+static int dhcpcd_wpa_bss_refresh(DHCPCD_WPA *);
+
+static void
+dhcpcd_wpa_scan_results(DHCPCD_WPA *wpa)
+{
+
+	if (wpa->con->wi_scanresults_cb)
+		wpa->con->wi_scanresults_cb(wpa,
+		    wpa->con->wi_scanresults_context);
+}
+
+/* The table is current, so report it unless more scan results
+ * came in while we were fetching it. */
+static void
+dhcpcd_wpa_bss_done(DHCPCD_WPA *wpa)
+{
+
+	if (wpa->bss_rescan) {
+		wpa->bss_rescan = false;
+		if (dhcpcd_wpa_bss_refresh(wpa) == 0)
+			return;
+	}
+	dhcpcd_wpa_scan_results(wpa);
+}
+
+static int dhcpcd_wpa_bss_load(DHCPCD_WPA *);
+
+static void
+dhcpcd_wpa_bss_loaded(DHCPCD_WPA *wpa, int error)
+{
+
+	wpa->bss_busy = false;
+	if (wpa->command_fd == -1)
+		return;
+	if (error == ENOTSUP && !wpa->bss_nomask) {
+		wpa->bss_nomask = true;
+		if (dhcpcd_wpa_bss_load(wpa) == 0)
+			return;
+		error = errno;
+	}
+	if (error != 0) {
+		dhcpcd_wpa_bss_clear(wpa);
+		return;
+	}
+	wpa->bss_loaded = true;
+	dhcpcd_wpa_bss_done(wpa);
+}
+
+/* Start fetching the whole table, reporting scan results once done. */
+static int
+dhcpcd_wpa_bss_load(DHCPCD_WPA *wpa)
+{
+
+	dhcpcd_wpa_bss_clear(wpa);
+	wpa->bss_loaded = false;
+	return dhcpcd_wpa_bss_walk(wpa, WPA_BSS_MASK,
+	    dhcpcd_wpa_bss_add, dhcpcd_wpa_bss_loaded);
+}
+
+static void
+dhcpcd_wpa_bss_fetch_cb(DHCPCD_WPA *wpa, int error, const char *reply,
+    size_t len, void *arg)
+{
+	DHCPCD_WPA_BSS b, *bp;
+	unsigned int id = (unsigned int)(uintptr_t)arg;
+	size_t pos;
+	int r;
+
+	/* The table has been dropped since we asked */
+	if (!wpa->bss_loaded && !wpa->bss_busy)
+		return;
+
+	if (error == 0 && len != 0 && strncmp(reply, "FAIL", 4) != 0) {
+		memset(&b, 0, sizeof(b));
+		b.id = id;
+		/* The reply is in our own buffer, so parse it in place */
+		r = dhcpcd_wpa_scan_parse(wpa, &b, wpa->cmd_reply);
+		if (r == 0)
+			r = dhcpcd_wpa_bss_add(wpa, &b);
+		dhcpcd_wpa_flags_put(wpa, b.text);
+		if (r == 0)
+			return;
+	}
+
+	/* It's already gone or we couldn't get it, so drop any
+	 * placeholder from a refresh. */
+	if ((bp = dhcpcd_wpa_bss_find(wpa, id, &pos)) != NULL &&
+	    !bp->bssid_set)
+		dhcpcd_wpa_bss_del(wpa, pos);
+}
+
+/* The last BSS a refresh missed is in, so report the results. */
+static void
+dhcpcd_wpa_bss_fetch_last_cb(DHCPCD_WPA *wpa, int error, const char *reply,
+    size_t len, void *arg)
+{
+
+	dhcpcd_wpa_bss_fetch_cb(wpa, error, reply, len, arg);
+	if (wpa->command_fd != -1)
+		dhcpcd_wpa_bss_done(wpa);
+}
+
+/* Fetch a single BSS, as notified by CTRL-EVENT-BSS-ADDED
+ * or missed by a refresh. */
+static int
+dhcpcd_wpa_bss_fetch(DHCPCD_WPA *wpa, unsigned int id, bool last)
+{
+	char buf[64];
+
+	if (wpa->bss_nomask)
+		snprintf(buf, sizeof(buf), "BSS ID-%u", id);
+	else
+		snprintf(buf, sizeof(buf), "BSS ID-%u MASK=0x%x",
+		    id, WPA_BSS_MASK & ~WPA_BSS_MASK_DELIM);
+	return dhcpcd_wpa_command_async(wpa, buf,
+	    last ? dhcpcd_wpa_bss_fetch_last_cb : dhcpcd_wpa_bss_fetch_cb,
+	    (void *)(uintptr_t)id);
+}
+
+static void
+dhcpcd_wpa_bss_remove(DHCPCD_WPA *wpa, unsigned int id)
+{
+	size_t pos;
+
+	if (dhcpcd_wpa_bss_find(wpa, id, &pos) != NULL)
+		dhcpcd_wpa_bss_del(wpa, pos);
+}
+
+static int
+dhcpcd_wpa_bss_refresh_cb(DHCPCD_WPA *wpa, const DHCPCD_WPA_BSS *nb)
+{
+	DHCPCD_WPA_BSS *b;
+
+	/* We missed the addition, so add a placeholder
+	 * without a BSSID to be fetched in full. */
+	if ((b = dhcpcd_wpa_bss_find(wpa, nb->id, NULL)) == NULL)
+		return dhcpcd_wpa_bss_add(wpa, nb);
+
+	b->age = nb->age;
+	b->gen = wpa->bss_gen;
+	b->quality = nb->quality;
+	b->noise = nb->noise;
+	b->level = nb->level;
+	b->strength = nb->strength;
+	return 0;
+}
+
+static void
+dhcpcd_wpa_bss_refreshed(DHCPCD_WPA *wpa, int error)
+{
+	DHCPCD_WPA_BSS *b;
+	size_t i, missed;
+	bool last;
+
+	wpa->bss_busy = false;
+	if (wpa->command_fd == -1)
+		return;
+	if (error != 0) {
+		if (error == ENOTSUP)
+			wpa->bss_nomask = true;
+		if (dhcpcd_wpa_bss_load(wpa) == -1)
+			dhcpcd_wpa_bss_free(wpa);
+		return;
+	}
+
+	/* Prune stale entries */
+	missed = 0;
+	for (i = 0; i < wpa->bss_len; ) {
+		b = &wpa->bss[i];
+		if (b->gen != wpa->bss_gen || b->age > WPA_BSS_EXPIRE)
+			dhcpcd_wpa_bss_del(wpa, i);
+		else {
+			if (!b->bssid_set)
+				missed++;
+			i++;
+		}
+	}
+
+	/* Fetch in full anything we missed. Replies come back in order,
+	 * so the last one in reports the results. */
+	last = false;
+	for (i = 0; missed != 0 && i < wpa->bss_len; i++) {
+		b = &wpa->bss[i];
+		if (b->bssid_set)
+			continue;
+		last = --missed == 0;
+		if (dhcpcd_wpa_bss_fetch(wpa, b->id, last) == -1) {
+			last = false;
+			break;
+		}
+	}
+	if (wpa->command_fd == -1)
+		return;
+	if (!last)
+		dhcpcd_wpa_bss_done(wpa);
+}
+
+/* Scan results are in.
+ * Additions and removals have already been applied from
+ * CTRL-EVENT-BSS-ADDED and CTRL-EVENT-BSS-REMOVED, so we only
+ * need to refresh the signal of each BSS.
+ * Anything we missed is fetched or removed and stale entries pruned.
+ * The results are reported once done. */
+static int
+dhcpcd_wpa_bss_refresh(DHCPCD_WPA *wpa)
+{
+
+	if (wpa->bss_busy) {
+		wpa->bss_rescan = true;
+		return 0;
+	}
+	if (!wpa->bss_loaded || wpa->bss_nomask)
+		return dhcpcd_wpa_bss_load(wpa);
+	wpa->bss_gen++;
+	return dhcpcd_wpa_bss_walk(wpa, WPA_BSS_MASK_SIGNAL,
+	    dhcpcd_wpa_bss_refresh_cb, dhcpcd_wpa_bss_refreshed);
+}
+
+int
+dhcpcd_wi_scan_compare(DHCPCD_WI_SCAN *a, DHCPCD_WI_SCAN *b)
+{
+	int cmp;
+
 	/* Fist sort non case sensitive, then case sensitive */
 	cmp = strcasecmp(a->ssid, b->ssid);
 	if (cmp == 0)
@@ -474,210 +1741,462 @@ dhcpcd_wi_scan_compare(DHCPCD_WI_SCAN *a, DHCPCD_WI_SCAN *b)
 	return cmp;
 }
 
-/*
- * This function is copyright 2001 Simon Tatham.
- *
- * Permission is hereby granted, free of charge, to any person
- * obtaining a copy of this software and associated documentation
- * files (the "Software"), to deal in the Software without
- * restriction, including without limitation the rights to use,
- * copy, modify, merge, publish, distribute, sublicense, and/or
- * sell copies of the Software, and to permit persons to whom the
- * Software is furnished to do so, subject to the following
- * conditions:
- *
- * The above copyright notice and this permission notice shall be
- * included in all copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
- * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
- * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
- * NONINFRINGEMENT.  IN NO EVENT SHALL SIMON TATHAM BE LIABLE FOR
- * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
- * CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
- * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
- * SOFTWARE.
- */
-static DHCPCD_WI_SCAN *
-dhcpcd_wi_scans_sort(DHCPCD_WI_SCAN *list)
+static unsigned int
+dhcpcd_wi_freqflags(int frequency)
 {
-	DHCPCD_WI_SCAN *p, *q, *e, *tail;
-	size_t insize, nmerges, psize, qsize, i;
 
-	/* Silly special case: if `list' was passed in as NULL, return
-	 * NULL immediately. */
-	if (!list)
-		return NULL;
+	if (WPA_FREQ_IS_2G(frequency))
+		return WSF_2G;
+	if (WPA_FREQ_IS_5G(frequency))
+		return WSF_5G;
+	/* Unknown frequency */
+	return 0;
+}
 
-	insize = 1;
+/* The next byte of the SSID as dhcpcd_encode_string_escape writes it,
+ * or 0 at the end. i indexes the SSID and e the escape within it. */
+static int
+dhcpcd_wpa_bss_ssid_esc(const DHCPCD_WPA_BSS *b, size_t *i, size_t *e)
+{
+	unsigned char c;
+	int r;
 
-	for (;;) {
-		p = list;
-		list = tail = NULL;
-		nmerges = 0;  /* count number of merges we do in this pass */
-
-		while (p) {
-			nmerges++;  /* there exists a merge to be done */
-			/* step `insize' places along from p */
-			q = p;
-			psize = 0;
-			for (i = 0; i < insize; i++) {
-				psize++;
-				q = q->next;
-				if (!q)
-					break;
-			}
+	if (*i == b->ssid_len)
+		return 0;
+	c = b->ssid[*i];
+	if (c != '\\' && isascii(c) && isprint(c)) {
+		(*i)++;
+		return c;
+	}
+	if (*e == 0 || c == '\\')
+		r = '\\';
+	else
+		r = '0' + ((c >> (3 * (3 - *e))) & (*e == 1 ? 03 : 07));
+	if (++*e == (c == '\\' ? 2 : 4)) {
+		*e = 0;
+		(*i)++;
+	}
+	return r;
+}
 
-			/* if q hasn't fallen off end,
-			 * we have two lists to merge */
-			qsize = insize;
-
-			/* now we have two lists; merge them */
-			while (psize > 0 || (qsize > 0 && q)) {
-				/* decide whether next element of merge comes
-				 * from p or q */
-				if (psize == 0) {
-					/* p is empty; e must come from q. */
-					e = q; q = q->next; qsize--;
-				} else if (qsize == 0 || !q) {
-					/* q is empty; e must come from p. */
-					e = p; p = p->next; psize--;
-				} else if (dhcpcd_wi_scan_compare(p, q) <= 0) {
-					/* First element of p is lower
-					 * (or same); e must come from p. */
-					e = p; p = p->next; psize--;
-				} else {
-					/* First element of q is lower;
-					 * e must come from q. */
-					e = q; q = q->next; qsize--;
-				}
+/* The same order as dhcpcd_wi_scan_compare, which sees the SSID
+ * escaped so that bytes outside printable ASCII sort as \ooo */
+static int
+dhcpcd_wpa_bss_ssid_cmp(const DHCPCD_WPA_BSS *a, const DHCPCD_WPA_BSS *b)
+{
+	size_t ia, ea, ib, eb;
+	int ca, cb;
+
+	/* Up to the first byte that differs both escape the same */
+	for (ia = 0; ia < a->ssid_len && ia < b->ssid_len; ia++) {
+		if (a->ssid[ia] != b->ssid[ia] &&
+		    (!isascii(a->ssid[ia]) || !isascii(b->ssid[ia]) ||
+		    tolower(a->ssid[ia]) != tolower(b->ssid[ia])))
+			break;
+	}
+	ib = ia;
+	ea = eb = 0;
+	do {
+		ca = tolower(dhcpcd_wpa_bss_ssid_esc(a, &ia, &ea));
+		cb = tolower(dhcpcd_wpa_bss_ssid_esc(b, &ib, &eb));
+	} while (ca == cb && ca != 0);
+	if (ca != cb)
+		return ca - cb;
+	/* Escaping keeps letters, so only their case can differ now */
+	return memcmp(a->ssid, b->ssid, a->ssid_len);
+}
 
-				/* add the next element to the merged list */
-				if (tail)
-					tail->next = e;
+static void
+dhcpcd_wpa_bss_key(DHCPCD_WPA_BSS_KEY *k, DHCPCD_WPA_BSS *b)
+{
+	char ssid[WBK_PREFIX_LEN * 4 + 1];
+	const uint8_t *p;
+	size_t i, len;
+	uint64_t key;
+
+	/* Escaping never shortens, so this much SSID fills the prefix */
+	len = b->ssid_len < WBK_PREFIX_LEN ? b->ssid_len : WBK_PREFIX_LEN;
+	for (i = 0; i < len; i++) {
+		if (b->ssid[i] == '\\' ||
+		    !isascii(b->ssid[i]) || !isprint(b->ssid[i]))
+			break;
+	}
+	if (i == len)
+		p = b->ssid;
+	else {
+		if (dhcpcd_encode_string_escape(ssid, sizeof(ssid),
+		    (const char *)b->ssid, len) == -1)
+			ssid[0] = '\0';
+		p = (const uint8_t *)ssid;
+		len = strlen(ssid);
+	}
+
+	key = 0;
+	for (i = 0; i < WBK_PREFIX_LEN; i++) {
+		if (i == sizeof(key)) {
+			k->key[0] = key;
+			key = 0;
+		}
+		key <<= 8;
+		if (i < len)
+			key |= (uint8_t)tolower(p[i]);
+	}
+	/* Inverted so the strongest sorts first */
+	key <<= 8;
+	key |= (uint8_t)(WBK_STRENGTH - CLAMP(b->strength, 0, WBK_STRENGTH));
+	k->key[1] = key;
+	k->hash = dhcpcd_hash(DHCPCD_HASH_INIT, b->ssid, b->ssid_len);
+	k->bss = b;
+}
+
+static bool
+dhcpcd_wpa_bss_key_eq(const DHCPCD_WPA_BSS_KEY *a, const DHCPCD_WPA_BSS_KEY *b)
+{
+
+	return a->hash == b->hash &&
+	    a->key[0] == b->key[0] &&
+	    (a->key[1] | WBK_STRENGTH) == (b->key[1] | WBK_STRENGTH) &&
+	    a->bss->ssid_len == b->bss->ssid_len &&
+	    memcmp(a->bss->ssid, b->bss->ssid, a->bss->ssid_len) == 0;
+}
+
+static inline int
+dhcpcd_wpa_bss_key_cmp(const DHCPCD_WPA_BSS_KEY *ka,
+    const DHCPCD_WPA_BSS_KEY *kb)
+{
+
+	/* Only when the prefixes match do we need the whole SSID */
+	if (ka->key[0] != kb->key[0])
+		return ka->key[0] < kb->key[0] ? -1 : 1;
+	if ((ka->key[1] ^ kb->key[1]) > WBK_STRENGTH)
+		return ka->key[1] < kb->key[1] ? -1 : 1;
+	if (!dhcpcd_wpa_bss_key_eq(ka, kb))
+		return dhcpcd_wpa_bss_ssid_cmp(ka->bss, kb->bss);
+	if (ka->key[1] != kb->key[1])
+		return ka->key[1] < kb->key[1] ? -1 : 1;
+	return 0;
+}
+
+/* Stable bottom up merge sort of keys using tmp, which must be as
+ * big as keys. Returns whichever of the two holds the sorted keys. */
+static DHCPCD_WPA_BSS_KEY *
+dhcpcd_wpa_bss_sort(DHCPCD_WPA_BSS_KEY *keys, DHCPCD_WPA_BSS_KEY *tmp, size_t n)
+{
+	DHCPCD_WPA_BSS_KEY *src, *dst, *t;
+	size_t w, lo, mid, hi, i, j, o;
+
+	src = keys;
+	dst = tmp;
+	for (w = 1; w < n; w *= 2) {
+		for (lo = 0; lo < n; lo += w * 2) {
+			mid = lo + w < n ? lo + w : n;
+			hi = mid + w < n ? mid + w : n;
+			i = lo;
+			j = mid;
+			o = lo;
+			while (i < mid && j < hi) {
+				if (dhcpcd_wpa_bss_key_cmp(&src[j], &src[i]) < 0)
+					dst[o++] = src[j++];
 				else
-					list = e;
-				tail = e;
+					dst[o++] = src[i++];
 			}
+			while (i < mid)
+				dst[o++] = src[i++];
+			while (j < hi)
+				dst[o++] = src[j++];
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	return src;
+}
+
+static void
+dhcpcd_wpa_bss_scan(DHCPCD_WI_SCAN *w, const DHCPCD_WPA_BSS *b)
+{
+
+	wpa_bssid_ntoa(w->bssid, sizeof(w->bssid), b->bssid);
+	if (dhcpcd_encode_string_escape(w->ssid, sizeof(w->ssid),
+	    (const char *)b->ssid, b->ssid_len) == -1)
+		w->ssid[0] = '\0';
+	if (b->text != NULL)
+		strlcpy(w->wpa_flags, b->text->text, sizeof(w->wpa_flags));
+	else
+		w->wpa_flags[0] = '\0';
+	w->flags = wpa_bss_secflags(b) | dhcpcd_wi_freqflags(b->frequency);
+	w->frequency = b->frequency;
+	w->quality.value = b->quality;
+	w->noise.value = b->noise;
+	w->level.value = b->level;
+	w->strength.value = b->strength;
+}
 
-			/* now p has stepped `insize' places along,
-			 * and q has too */
-			p = q;
+/* Signal history is kept per interface and BSS so we can average it.
+ * Each BSS has a fixed ring of samples and is forgotten once it has
+ * not been seen for a while. */
+struct wi_hist_key {
+	const char *ifname;
+	const char *bssid;
+};
+
+static bool
+dhcpcd_wi_hist_match(const void *item, const void *key)
+{
+	const DHCPCD_WI_HIST *h = item;
+	const struct wi_hist_key *k = key;
+
+	return strcmp(h->bssid, k->bssid) == 0 &&
+	    strcmp(h->ifname, k->ifname) == 0;
+}
+
+static uint32_t
+dhcpcd_wi_hist_hash(const struct wi_hist_key *k)
+{
+
+	return dhcpcd_hash(dhcpcd_hash(DHCPCD_HASH_INIT,
+	    k->ifname, strlen(k->ifname) + 1), k->bssid, strlen(k->bssid));
+}
+
+static DHCPCD_WI_HIST *
+dhcpcd_wi_hist_find(DHCPCD_CONNECTION *con, const char *ifname,
+    const char *bssid)
+{
+	struct wi_hist_key k = { ifname, bssid };
+
+	return dhcpcd_hmap_find(&con->wi_history_map,
+	    dhcpcd_wi_hist_hash(&k), dhcpcd_wi_hist_match, &k);
+}
+
+/* Record the scan in the history and set its averages from it */
+static void
+dhcpcd_wi_hist_add(DHCPCD_WPA *wpa, const char *bssid,
+    const DHCPCD_WPA_BSS *b, uint64_t now, DHCPCD_WI_SAMPLE *avg)
+{
+	DHCPCD_CONNECTION *con = wpa->con;
+	struct wi_hist_key k = { wpa->ifname, bssid };
+	uint32_t hash;
+	DHCPCD_WI_HIST *h;
+	size_t n;
+
+	/* Without history the average is just this sample */
+	avg->quality = b->quality;
+	avg->noise = b->noise;
+	avg->level = b->level;
+	avg->strength = b->strength;
+
+	hash = dhcpcd_wi_hist_hash(&k);
+	h = dhcpcd_hmap_find(&con->wi_history_map, hash,
+	    dhcpcd_wi_hist_match, &k);
+	if (h == NULL) {
+		if ((h = calloc(1, sizeof(*h))) == NULL)
+			return;
+		wpa->scan_stats.allocs++;
+		strlcpy(h->ifname, wpa->ifname, sizeof(h->ifname));
+		strlcpy(h->bssid, bssid, sizeof(h->bssid));
+		if (dhcpcd_hmap_add(&con->wi_history_map, hash, h) == -1) {
+			free(h);
+			return;
 		}
-		tail->next = NULL;
+		h->next = con->wi_history;
+		con->wi_history = h;
+	}
 
-		/* If we have done only one merge, we're finished. */
-		if (nmerges <= 1)   /* allow for nmerges==0, the empty list */
-			return list;
+	h->seen = now;
+	h->samples[h->pos] = *avg;
+	h->pos = (h->pos + 1) % DHCPCD_WI_HIST_MAX;
+	if (h->len < DHCPCD_WI_HIST_MAX)
+		h->len++;
+	if (h->len == 1)
+		return;
 
-		/* Otherwise repeat, merging lists twice the size */
-		insize *= 2;
+	memset(avg, 0, sizeof(*avg));
+	for (n = 0; n < h->len; n++) {
+		avg->quality += h->samples[n].quality;
+		avg->noise += h->samples[n].noise;
+		avg->level += h->samples[n].level;
+		avg->strength += h->samples[n].strength;
 	}
+	avg->quality /= (int)h->len;
+	avg->noise /= (int)h->len;
+	avg->level /= (int)h->len;
+	avg->strength /= (int)h->len;
 }
 
-static unsigned int
-dhcpcd_wi_freqflags(DHCPCD_WI_SCAN *w)
+static void
+dhcpcd_wi_hist_expire(DHCPCD_CONNECTION *con, uint64_t now)
 {
+	DHCPCD_WI_HIST *h, **hp;
+	struct wi_hist_key k;
 
-	if (WPA_FREQ_IS_2G(w->frequency))
-		return WSF_2G;
-	if (WPA_FREQ_IS_5G(w->frequency))
-		return WSF_5G;
-	/* Unknown frequency */
-	return 0;
+	hp = &con->wi_history;
+	while ((h = *hp) != NULL) {
+		if (h->seen + DHCPCD_WI_HIST_EXPIRE > now) {
+			hp = &h->next;
+			continue;
+		}
+		k.ifname = h->ifname;
+		k.bssid = h->bssid;
+		dhcpcd_hmap_del(&con->wi_history_map,
+		    dhcpcd_wi_hist_hash(&k), dhcpcd_wi_hist_match, &k);
+		*hp = h->next;
+		free(h);
+	}
 }
 
+void
+dhcpcd_wi_history_clear(DHCPCD_CONNECTION *con)
+{
+	DHCPCD_WI_HIST *h;
+
+	assert(con);
+	while ((h = con->wi_history) != NULL) {
+		con->wi_history = h->next;
+		free(h);
+	}
+	dhcpcd_hmap_clear(&con->wi_history_map);
+}
+
+/* The members of a scan, strongest first.
+ * s must be from dhcpcd_wi_scans and not a copy of one. */
+const DHCPCD_WI_BSS *
+dhcpcd_wi_scan_bss(const DHCPCD_WI_SCAN *s, size_t *len)
+{
+	const DHCPCD_WI_SCAN_ENTRY *e;
+
+	assert(s);
+	assert(len);
+	e = (const DHCPCD_WI_SCAN_ENTRY *)(const void *)s;
+	*len = e->bss_len;
+	return e->bss;
+}
+
+/* Members are strongest first, so the first in a band is the best.
+ * A band of 0 matches any. */
+const DHCPCD_WI_BSS *
+dhcpcd_wi_scan_best(const DHCPCD_WI_SCAN *s, unsigned int band)
+{
+	const DHCPCD_WI_BSS *bss;
+	size_t i, len;
+
+	bss = dhcpcd_wi_scan_bss(s, &len);
+	for (i = 0; i < len; i++) {
+		if (band == 0 ||
+		    dhcpcd_wi_freqflags(bss[i].frequency) & band)
+			return &bss[i];
+	}
+	return NULL;
+}
+
+/* Results are sorted alphabetically and then by strength with
+ * one result per SSID, described by the strongest BSS and listing
+ * every BSS with that SSID as a member.
+ * They are a single array of entries, linked in order, followed by
+ * the members,
+ * so the list API still works and dhcpcd_wi_scans_free has just the
+ * one thing to free.
+ * Sorting is done on a scratch table of keys reused between scans,
+ * so once the tables have grown the only allocation is the results. */
 DHCPCD_WI_SCAN *
 dhcpcd_wi_scans(DHCPCD_IF *i)
 {
 	DHCPCD_WPA *wpa;
-	DHCPCD_WI_SCAN *wis, *w, *n, *p;
-	int nh;
-	DHCPCD_WI_HIST *h, *hl;
+	DHCPCD_WPA_BSS_KEY *order;
+	DHCPCD_WPA_BSS *b;
+	DHCPCD_WI_SCAN_ENTRY *wis, *w;
+	DHCPCD_WI_BSS *members, *m;
+	DHCPCD_WI_SAMPLE avg;
+	size_t j, n, nscans;
+	uint64_t now;
 
 	wpa = dhcpcd_wpa_find(i->con, i->ifname);
 	if (wpa == NULL)
 		return NULL;
-	wis = dhcpcd_wpa_scans_read(wpa);
+	/* Scan results are reported again once loaded */
+	if (!wpa->bss_loaded) {
+		if (!wpa->bss_busy && wpa->command_fd != -1)
+			dhcpcd_wpa_bss_load(wpa);
+		return NULL;
+	}
+	if (wpa->bss_len == 0)
+		return NULL;
 
-	/* Sort the resultant list alphabetically and then by strength */
-	wis = dhcpcd_wi_scans_sort(wis);
+	/* Keys then the same again for the sort to merge into */
+	if (wpa->bss_order_size < wpa->bss_size) {
+		order = realloc(wpa->bss_order,
+		    sizeof(*order) * wpa->bss_size * 2);
+		if (order == NULL)
+			return NULL;
+		wpa->bss_order = order;
+		wpa->bss_order_size = wpa->bss_size;
+		wpa->scan_stats.allocs++;
+	}
+	order = wpa->bss_order;
 
-	p = NULL;
-	for (w = wis; w && (n = w->next, 1); w = n) {
-		/* Currently we don't support non SSID broadcasting APs */
-		if (*w->ssid == '\0') {
-			if (p == NULL)
-				wis = n;
-			else
-				p->next = n;
-			free(w);
-			continue;
-		}
-		/* Strip duplicated SSIDs, only show the strongest */
-		if (p && strcmp(p->ssid, w->ssid) == 0) {
-			/* Set frequency flag from the duplicate */
-			p->flags |= dhcpcd_wi_freqflags(w);
-			p->next = n;
-			free(w);
-			continue;
-		}
-		/* Remember this as the previous next time */
-		p = w;
-
-		/* Set frequency flags */
-		p->flags |= dhcpcd_wi_freqflags(w);
-
-		nh = 1;
-		hl = NULL;
-		w->quality.average = w->quality.value;
-		w->noise.average = w->noise.value;
-		w->level.average = w->level.value;
-		w->strength.average = w->strength.value;
-
-		for (h = wpa->con->wi_history; h; h = h->next) {
-			if (strcmp(h->ifname, i->ifname) == 0 &&
-			    strcmp(h->bssid, wis->bssid) == 0)
-			{
-				w->quality.average += h->quality;
-				w->noise.average += h->noise;
-				w->level.average += h->level;
-				w->strength.average += h->strength;
-				if (++nh == DHCPCD_WI_HIST_MAX) {
-					hl->next = h->next;
-					free(h);
-					break;
-				}
-			}
-			hl = h;
-		}
+	/* Currently we don't support non SSID broadcasting APs */
+	n = 0;
+	for (j = 0; j < wpa->bss_len; j++) {
+		if (wpa->bss[j].ssid_len != 0 && wpa->bss[j].bssid_set)
+			dhcpcd_wpa_bss_key(&order[n++], &wpa->bss[j]);
+	}
+	order = dhcpcd_wpa_bss_sort(order, order + wpa->bss_size, n);
 
-		if (nh != 1) {
-			w->quality.average /= nh;
-			w->noise.average /= nh;
-			w->level.average /= nh;
-			w->strength.average /= nh;
+	nscans = 0;
+	for (j = 0; j < n; j++) {
+		if (j == 0 || !dhcpcd_wpa_bss_key_eq(&order[j - 1], &order[j]))
+			nscans++;
+	}
+	if (nscans == 0)
+		return NULL;
+	/* DHCPCD_WI_SCAN_ENTRY is at least as aligned as DHCPCD_WI_BSS */
+	wis = calloc(1, nscans * sizeof(*wis) + n * sizeof(*members));
+	if (wis == NULL)
+		return NULL;
+	members = (DHCPCD_WI_BSS *)(void *)(wis + nscans);
+	wpa->scan_stats.batches++;
+	wpa->scan_stats.allocs++;
+
+	now = dhcpcd_now();
+	w = NULL;
+	for (j = 0; j < n; j++) {
+		b = order[j].bss;
+		m = &members[j];
+		wpa_bssid_ntoa(m->bssid, sizeof(m->bssid), b->bssid);
+		m->frequency = b->frequency;
+		dhcpcd_wi_hist_add(wpa, m->bssid, b, now, &avg);
+		m->strength.value = b->strength;
+		m->strength.average = avg.strength;
+
+		/* Duplicated SSIDs join the strongest as members */
+		if (w != NULL && dhcpcd_wpa_bss_key_eq(&order[j - 1], &order[j])) {
+			w->scan.flags |= dhcpcd_wi_freqflags(b->frequency);
+			w->bss_len++;
+			continue;
 		}
-		h = malloc(sizeof(*h));
-		if (h) {
-			strlcpy(h->ifname, i->ifname, sizeof(h->ifname));
-			strlcpy(h->bssid, w->bssid, sizeof(h->bssid));
-			h->quality = w->quality.value;
-			h->noise = w->noise.value;
-			h->level = w->level.value;
-			h->strength = w->strength.value;
-			h->next = wpa->con->wi_history;
-			wpa->con->wi_history = h;
+		if (w == NULL)
+			w = wis;
+		else {
+			w->scan.next = &w[1].scan;
+			w++;
 		}
+		dhcpcd_wpa_bss_scan(&w->scan, b);
+		w->scan.quality.average = avg.quality;
+		w->scan.noise.average = avg.noise;
+		w->scan.level.average = avg.level;
+		w->scan.strength.average = avg.strength;
+		w->bss = m;
+		w->bss_len = 1;
 	}
+	dhcpcd_wi_hist_expire(wpa->con, now);
 
-	return wis;
+	return &wis->scan;
 }
 
 bool
 dhcpcd_wpa_reconfigure(DHCPCD_WPA *wpa)
 {
 
+	wpa->net_loaded = false;
 	return dhcpcd_wpa_command(wpa, "RECONFIGURE");
 }
 
@@ -711,6 +2230,7 @@ dhcpcd_wpa_network(DHCPCD_WPA *wpa, const char *cmd, int id)
 	if (!dhcpcd_realloc(wpa->con, len))
 		return false;
 	snprintf(wpa->con->buf, wpa->con->buflen, "%s %d", cmd, id);
+	wpa->net_loaded = false;
 	return dhcpcd_wpa_command(wpa, wpa->con->buf);
 }
 
@@ -751,7 +2271,7 @@ dhcpcd_wpa_network_get(DHCPCD_WPA *wpa, int id, const char *param)
 		return NULL;
 	snprintf(wpa->con->buf, wpa->con->buflen, "GET_NETWORK %d %s",
 	    id, param);
-	bytes = wpa_cmd(wpa->command_fd, wpa->con->buf,
+	bytes = wpa_cmd_wait(wpa, wpa->con->buf,
 	    wpa->con->buf, wpa->con->buflen);
 	if (bytes == 0 || bytes == -1)
 		return NULL;
@@ -773,29 +2293,58 @@ dhcpcd_wpa_network_set(DHCPCD_WPA *wpa, int id,
 		return false;
 	snprintf(wpa->con->buf, wpa->con->buflen, "SET_NETWORK %d %s %s",
 	    id, param, value);
+	wpa->net_loaded = false;
 	return dhcpcd_wpa_command(wpa, wpa->con->buf);
 }
 
-static int
-dhcpcd_wpa_network_find(DHCPCD_WPA *wpa, const char *fssid)
+/* wpa_supplicant stops listing networks when the next one won't
+ * fit in its 4k reply, so a reply this long may have more to come. */
+#define	WPA_LIST_MORE		(4096 - 256)
+
+static void
+dhcpcd_wpa_net_free(DHCPCD_WPA *wpa)
+{
+
+	dhcpcd_hmap_clear(&wpa->net_map);
+	free(wpa->net);
+	wpa->net = NULL;
+	wpa->net_len = wpa->net_size = 0;
+	wpa->net_loaded = false;
+}
+
+static bool
+dhcpcd_wpa_net_match(const void *item, const void *key)
+{
+	const DHCPCD_WPA_NET *n = item;
+
+	return strcmp(n->ssid, key) == 0;
+}
+
+static DHCPCD_WPA_NET *
+dhcpcd_wpa_net_find(DHCPCD_WPA *wpa, const char *ssid)
 {
-	ssize_t bytes, dl, tl;
-	size_t fl;
-	char *s, *t, *ssid, *bssid, *flags;
-	char dssid[IF_SSIDSIZE], tssid[IF_SSIDSIZE];
-	long l;
 
-	dhcpcd_realloc(wpa->con, 2048);
-	bytes = wpa_cmd(wpa->command_fd, "LIST_NETWORKS",
-	    wpa->con->buf, wpa->con->buflen);
-	if (bytes == 0 || bytes == -1)
-		return -1;
+	return dhcpcd_hmap_find(&wpa->net_map,
+	    dhcpcd_hash(DHCPCD_HASH_INIT, ssid, strlen(ssid)),
+	    dhcpcd_wpa_net_match, ssid);
+}
 
-	fl = strlen(fssid);
+/* Parse a LIST_NETWORKS reply into the table.
+ * Returns the number of networks read, setting last to the
+ * id of the last one. */
+static ssize_t
+dhcpcd_wpa_net_parse(DHCPCD_WPA *wpa, char *buf, int *last)
+{
+	DHCPCD_WPA_NET *n;
+	ssize_t dl, tl, nets;
+	char *s, *t, *ssid, *bssid, *flags;
+	char dssid[IF_SSIDSIZE];
+	long l;
 
-	s = strchr(wpa->con->buf, '\n');
+	nets = 0;
+	s = strchr(buf, '\n');
 	if (s == NULL)
-		return -1;
+		return 0;
 	while ((t = strsep(&s, "\b\n"))) {
 		if (*t == '\0')
 			continue;
@@ -814,24 +2363,148 @@ dhcpcd_wpa_network_find(DHCPCD_WPA *wpa, const char *fssid)
 		l = strtol(t, NULL, 0);
 		if (l < 0 || l > INT_MAX) {
 			errno = ERANGE;
-			break;
+			return -1;
 		}
 
+		if (wpa->net_len == wpa->net_size) {
+			size_t nsize;
+
+			nsize = wpa->net_size == 0 ? 8 : wpa->net_size * 2;
+			n = realloc(wpa->net, nsize * sizeof(*n));
+			if (n == NULL)
+				return -1;
+			wpa->net = n;
+			wpa->net_size = nsize;
+		}
+		n = &wpa->net[wpa->net_len];
+		memset(n, 0, sizeof(*n));
+		n->id = (int)l;
+		if (strstr(flags, "[CURRENT]"))
+			n->flags |= WNF_CURRENT;
+		if (strstr(flags, "[DISABLED]"))
+			n->flags |= WNF_DISABLED;
+
 		/* Decode the wpa_supplicant SSID into raw chars and
 		 * then encode into our octal escaped string to
 		 * compare. */
 		dl = dhcpcd_wpa_decode_ssid(dssid, sizeof(dssid), ssid);
 		if (dl == -1)
 			return -1;
-		tl = dhcpcd_encode_string_escape(tssid,
-		    sizeof(tssid), dssid, (size_t)dl);
+		tl = dhcpcd_encode_string_escape(n->ssid,
+		    sizeof(n->ssid), dssid, (size_t)dl);
 		if (tl == -1)
 			return -1;
-		if ((size_t)tl == fl && memcmp(tssid, fssid, (size_t)tl) == 0)
-			return (int)l;
+		wpa->net_len++;
+		*last = n->id;
+		nets++;
 	}
-	errno = ENOENT;
-	return -1;
+	return nets;
+}
+
+/* Load the configured networks along with their key management
+ * so configure can work out what needs changing.
+ * The table is kept until a network is added or removed. */
+static int
+dhcpcd_wpa_net_load(DHCPCD_WPA *wpa)
+{
+	struct wpa_txn txn = { 0, DHCPCD_WPA_SUCCESS };
+	DHCPCD_WPA_NET *n;
+	ssize_t bytes, nets;
+	char buf[64];
+	int last = -1;
+	size_t i;
+
+	if (wpa->net_loaded)
+		return 0;
+
+	if (!dhcpcd_realloc(wpa->con, WPA_REPLY_SIZE))
+		return -1;
+	dhcpcd_hmap_clear(&wpa->net_map);
+	wpa->net_len = 0;
+	strlcpy(buf, "LIST_NETWORKS", sizeof(buf));
+	for (;;) {
+		bytes = wpa_cmd_wait(wpa, buf,
+		    wpa->con->buf, wpa->con->buflen);
+		if (bytes == -1)
+			return -1;
+		/* Older wpa_supplicant doesn't know LAST_ID */
+		if (bytes == 0 || strncmp(wpa->con->buf, "FAIL", 4) == 0 ||
+		    strncmp(wpa->con->buf, "UNKNOWN", 7) == 0)
+			break;
+		if ((nets = dhcpcd_wpa_net_parse(wpa,
+		    wpa->con->buf, &last)) == -1)
+			return -1;
+		if (nets == 0 || bytes < WPA_LIST_MORE)
+			break;
+		snprintf(buf, sizeof(buf), "LIST_NETWORKS LAST_ID=%d", last);
+	}
+
+	for (i = 0; i < wpa->net_len; i++) {
+		n = &wpa->net[i];
+		/* Keep the first network for each SSID, like
+		 * wpa_supplicant */
+		if (dhcpcd_wpa_net_find(wpa, n->ssid) != NULL)
+			continue;
+		if (dhcpcd_hmap_add(&wpa->net_map,
+		    dhcpcd_hash(DHCPCD_HASH_INIT, n->ssid, strlen(n->ssid)),
+		    n) == -1)
+			return -1;
+	}
+
+	/* An empty key_mgmt just means it will always be set. */
+	for (i = 0; i < wpa->net_len; i++) {
+		n = &wpa->net[i];
+		snprintf(buf, sizeof(buf), "GET_NETWORK %d key_mgmt", n->id);
+		if (!wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR, buf,
+		    n->key_mgmt, sizeof(n->key_mgmt)))
+			break;
+	}
+	wpa_txn_wait(wpa, &txn);
+	if (wpa->command_fd == -1)
+		return -1;
+
+	wpa->net_loaded = true;
+	return 0;
+}
+
+/* Track the current network from the connection events
+ * so the table stays valid. */
+static void
+dhcpcd_wpa_net_current(DHCPCD_WPA *wpa, const char *event)
+{
+	const char *p;
+	int id;
+	size_t i;
+
+	id = -1;
+	if (event != NULL) {
+		if ((p = strstr(event, "[id=")) == NULL ||
+		    dhcpcd_strtoi(&id, p + 4) == -1)
+		{
+			wpa->net_loaded = false;
+			return;
+		}
+	}
+	for (i = 0; i < wpa->net_len; i++) {
+		if (wpa->net[i].id == id)
+			wpa->net[i].flags |= WNF_CURRENT;
+		else
+			wpa->net[i].flags &= ~WNF_CURRENT;
+	}
+}
+
+static int
+dhcpcd_wpa_network_find(DHCPCD_WPA *wpa, const char *fssid)
+{
+	DHCPCD_WPA_NET *n;
+
+	if (dhcpcd_wpa_net_load(wpa) == -1)
+		return -1;
+	if ((n = dhcpcd_wpa_net_find(wpa, fssid)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	return n->id;
 }
 
 static int
@@ -841,7 +2514,8 @@ dhcpcd_wpa_network_new(DHCPCD_WPA *wpa)
 	long l;
 
 	dhcpcd_realloc(wpa->con, 32);
-	bytes = wpa_cmd(wpa->command_fd, "ADD_NETWORK",
+	wpa->net_loaded = false;
+	bytes = wpa_cmd_wait(wpa, "ADD_NETWORK",
 	    wpa->con->buf, sizeof(wpa->con->buf));
 	if (bytes == 0 || bytes == -1)
 		return -1;
@@ -854,18 +2528,14 @@ dhcpcd_wpa_network_new(DHCPCD_WPA *wpa)
 }
 
 static const char hexchrs[] = "0123456789abcdef";
-int
-dhcpcd_wpa_network_find_new(DHCPCD_WPA *wpa, const char *ssid)
+/* Encode our escaped SSID for SET_NETWORK. */
+static int
+dhcpcd_wpa_network_ssid(char *essid, const char *ssid)
 {
-	int id;
-	char dssid[IF_SSIDSIZE], essid[IF_SSIDSIZE], *ep;
+	char dssid[IF_SSIDSIZE], *ep;
 	ssize_t dl, i;
 	char *dp;
 
-	id = dhcpcd_wpa_network_find(wpa, ssid);
-	if (id != -1)
-		return id;
-
 	dl = dhcpcd_decode_string_escape(dssid, sizeof(dssid), ssid);
 	if (dl == -1)
 		return -1;
@@ -893,7 +2563,21 @@ dhcpcd_wpa_network_find_new(DHCPCD_WPA *wpa, const char *ssid)
 		*ep++ = '\"';
 	}
 	*ep = '\0';
+	return 0;
+}
 
+int
+dhcpcd_wpa_network_find_new(DHCPCD_WPA *wpa, const char *ssid)
+{
+	int id;
+	char essid[IF_SSIDSIZE];
+
+	id = dhcpcd_wpa_network_find(wpa, ssid);
+	if (id != -1)
+		return id;
+
+	if (dhcpcd_wpa_network_ssid(essid, ssid) == -1)
+		return -1;
 	id = dhcpcd_wpa_network_new(wpa);
 	if (id != -1)
 		dhcpcd_wpa_network_set(wpa, id, "ssid", essid);
@@ -917,10 +2601,18 @@ dhcpcd_wpa_close(DHCPCD_WPA *wpa)
 		dhcpcd_wpa_update_status(wpa, DHC_DOWN);
 	}
 
+	dhcpcd_wpa_bss_free(wpa);
+	dhcpcd_wpa_net_free(wpa);
+
 	close(wpa->command_fd);
 	wpa->command_fd = -1;
 	close(wpa->listen_fd);
 	wpa->listen_fd = -1;
+	free(wpa->event_buf);
+	wpa->event_buf = NULL;
+	wpa_cmd_flush(wpa, ECONNRESET);
+	free(wpa->cmd_reply);
+	wpa->cmd_reply = NULL;
 	unlink(wpa->command_path);
 	free(wpa->command_path);
 	wpa->command_path = NULL;
@@ -929,17 +2621,24 @@ dhcpcd_wpa_close(DHCPCD_WPA *wpa)
 	wpa->listen_path = NULL;
 }
 
+static bool
+dhcpcd_wpa_match(const void *item, const void *key)
+{
+
+	return strcmp(((const DHCPCD_WPA *)item)->ifname, key) == 0;
+}
+
 DHCPCD_WPA *
 dhcpcd_wpa_find(DHCPCD_CONNECTION *con, const char *ifname)
 {
 	DHCPCD_WPA *wpa;
 
-	for (wpa = con->wpa; wpa; wpa = wpa->next) {
-		if (strcmp(wpa->ifname, ifname) == 0)
-			return wpa;
-	}
-	errno = ENOENT;
-	return NULL;
+	wpa = dhcpcd_hmap_find(&con->wpa_map,
+	    dhcpcd_hash(DHCPCD_HASH_INIT, ifname, strlen(ifname)),
+	    dhcpcd_wpa_match, ifname);
+	if (wpa == NULL)
+		errno = ENOENT;
+	return wpa;
 }
 
 DHCPCD_WPA *
@@ -960,6 +2659,14 @@ dhcpcd_wpa_new(DHCPCD_CONNECTION *con, const char *ifname)
 	wpa->status = DHC_DOWN;
 	wpa->command_fd = wpa->listen_fd = -1;
 	wpa->command_path = wpa->listen_path = NULL;
+	wpa->cmd_tail = &wpa->cmd_head;
+	if (dhcpcd_hmap_add(&con->wpa_map,
+	    dhcpcd_hash(DHCPCD_HASH_INIT, wpa->ifname, strlen(wpa->ifname)),
+	    wpa) == -1)
+	{
+		free(wpa);
+		return NULL;
+	}
 	wpa->next = con->wpa;
 	con->wpa = wpa;
 	return wpa;
@@ -1028,6 +2735,12 @@ dhcpcd_wpa_open(DHCPCD_WPA *wpa)
 	wpa->command_path = cmd_path;
 	wpa->listen_fd = list_fd;
 	wpa->listen_path = list_path;
+	wpa->bss_nomask = false;
+	wpa->bss_loaded = false;
+	wpa->ping_due = dhcpcd_now() + DHCPCD_WPA_PING;
+	wpa->roamed = 0;
+	wpa->scan_interval = DHCPCD_WPA_SCAN_SHORT;
+	wpa->scan_due = dhcpcd_now() + wpa->scan_interval;
 	if (!dhcpcd_attach_detach(wpa, true)) {
 		dhcpcd_wpa_close(wpa);
 		return -1;
@@ -1036,9 +2749,9 @@ dhcpcd_wpa_open(DHCPCD_WPA *wpa)
 	dhcpcd_wpa_if_freq(wpa);
 
 	dhcpcd_wpa_update_status(wpa, DHC_CONNECTED);
-	if (wpa->con->wi_scanresults_cb)
-		wpa->con->wi_scanresults_cb(wpa,
-		    wpa->con->wi_scanresults_context);
+	/* Results are reported again once the table has loaded */
+	dhcpcd_wpa_bss_load(wpa);
+	dhcpcd_wpa_scan_results(wpa);
 
 	return wpa->listen_fd;
 
@@ -1094,21 +2807,68 @@ void dhcpcd_wpa_set_status_callback(DHCPCD_CONNECTION * con,
 	con->wpa_status_context = context;
 }
 
-void
-dhcpcd_wpa_dispatch(DHCPCD_WPA *wpa)
-{
-	char buffer[256], *p;
-	size_t bytes;
+/* wpa_supplicant events are at most 4k and come in bursts while
+ * scanning, so read as many as we can per wakeup.
+ * Linux only queues 10 datagrams on a socket by default. */
+#define	WPA_EVENT_SIZE		4096
+#define	WPA_EVENT_BATCH		16
 
-	assert(wpa);
-	bytes = (size_t)read(wpa->listen_fd, buffer, sizeof(buffer));
-	if ((ssize_t)bytes == -1) {
-		dhcpcd_wpa_close(wpa);
-		return;
+static int
+wpa_event_recv(DHCPCD_WPA *wpa, size_t *lens)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[WPA_EVENT_BATCH];
+	struct iovec iov[WPA_EVENT_BATCH];
+	int i, n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < WPA_EVENT_BATCH; i++) {
+		iov[i].iov_base = wpa->event_buf + (i * WPA_EVENT_SIZE);
+		iov[i].iov_len = WPA_EVENT_SIZE - 1;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(wpa->listen_fd, msgs, WPA_EVENT_BATCH, MSG_DONTWAIT,
+	    NULL);
+	for (i = 0; i < n; i++)
+		lens[i] = msgs[i].msg_len;
+	return n;
+#else
+	ssize_t bytes;
+	int n;
+
+	for (n = 0; n < WPA_EVENT_BATCH; n++) {
+		bytes = recv(wpa->listen_fd,
+		    wpa->event_buf + (n * WPA_EVENT_SIZE),
+		    WPA_EVENT_SIZE - 1, MSG_DONTWAIT);
+		if (bytes == -1)
+			return n == 0 ? -1 : n;
+		lens[n] = (size_t)bytes;
 	}
+	return n;
+#endif
+}
+
+#define	CE_SCAN_RESULTS		"CTRL-EVENT-SCAN-RESULTS"
+#define	CE_BSS_ADDED		"CTRL-EVENT-BSS-ADDED "
+#define	CE_BSS_REMOVED		"CTRL-EVENT-BSS-REMOVED "
+#define	CE_CONNECTED		"CTRL-EVENT-CONNECTED"
+#define	CE_DISCONNECTED		"CTRL-EVENT-DISCONNECTED"
+#define	CE_TERMINATING		"CTRL-EVENT-TERMINATING"
+#define	CE_NETWORK_ADDED	"CTRL-EVENT-NETWORK-ADDED "
+#define	CE_NETWORK_REMOVED	"CTRL-EVENT-NETWORK-REMOVED "
+
+/* Returns true if the event was scan results, which we report
+ * once per batch. */
+static bool
+dhcpcd_wpa_event(DHCPCD_WPA *wpa, char *buffer, size_t bytes)
+{
+	char *p;
 
 	buffer[bytes] = '\0';
 	bytes = strlen(buffer);
+	if (bytes == 0)
+		return false;
 	if (buffer[bytes - 1] == ' ')
 		buffer[--bytes] = '\0';
 	for (p = buffer + 1; *p != '\0'; p++) {
@@ -1118,20 +2878,81 @@ dhcpcd_wpa_dispatch(DHCPCD_WPA *wpa)
 		}
 	}
 
-#define	CE_SCAN_RESULTS		"CTRL-EVENT-SCAN-RESULTS"
-#define	CE_CONNECTED		"CTRL-EVENT-CONNECTED"
-#define	CE_DISCONNECTED		"CTRL-EVENT-DISCONNECTED"
-#define	CE_TERMINATING		"CTRL-EVENT-TERMINATING"
-	if (strncmp(p, CE_SCAN_RESULTS, strlen(CE_SCAN_RESULTS)) == 0 &&
-	    wpa->con->wi_scanresults_cb)
-		wpa->con->wi_scanresults_cb(wpa,
-		    wpa->con->wi_scanresults_context);
-	else if (strncmp(p, CE_CONNECTED, strlen(CE_CONNECTED)) == 0)
+	if (strncmp(p, CE_SCAN_RESULTS, strlen(CE_SCAN_RESULTS)) == 0)
+		return true;
+	if (strncmp(p, CE_BSS_ADDED, strlen(CE_BSS_ADDED)) == 0) {
+		/* If we can't ask for it, a refresh will find it */
+		if (wpa->bss_loaded)
+			dhcpcd_wpa_bss_fetch(wpa, (unsigned int)strtoul(
+			    p + strlen(CE_BSS_ADDED), NULL, 10), false);
+	} else if (strncmp(p, CE_BSS_REMOVED, strlen(CE_BSS_REMOVED)) == 0) {
+		if (wpa->bss_loaded)
+			dhcpcd_wpa_bss_remove(wpa, (unsigned int)strtoul(
+			    p + strlen(CE_BSS_REMOVED), NULL, 10));
+	} else if (strncmp(p, CE_CONNECTED, strlen(CE_CONNECTED)) == 0) {
+		dhcpcd_wpa_net_current(wpa, p);
+		if (wpa->select_started != 0) {
+			wpa->select_time =
+			    (unsigned int)(dhcpcd_now() - wpa->select_started);
+			wpa->select_started = 0;
+		}
 		dhcpcd_wpa_if_freq(wpa);
-	else if (strncmp(p, CE_DISCONNECTED, strlen(CE_DISCONNECTED)) == 0)
+		wpa->roamed = dhcpcd_now();
+		dhcpcd_wpa_scan_schedule(wpa, wpa->roamed);
+	} else if (strncmp(p, CE_DISCONNECTED, strlen(CE_DISCONNECTED)) == 0) {
+		dhcpcd_wpa_net_current(wpa, NULL);
 		dhcpcd_wpa_if_freq_zero(wpa);
+		wpa->bssid[0] = '\0';
+		dhcpcd_wpa_scan_schedule(wpa, dhcpcd_now());
+	} else if (strncmp(p, CE_NETWORK_ADDED, strlen(CE_NETWORK_ADDED)) == 0 ||
+	    strncmp(p, CE_NETWORK_REMOVED, strlen(CE_NETWORK_REMOVED)) == 0)
+		wpa->net_loaded = false;
 	else if (strncmp(p, CE_TERMINATING, strlen(CE_TERMINATING)) == 0)
 		dhcpcd_wpa_close(wpa);
+	return false;
+}
+
+void
+dhcpcd_wpa_dispatch(DHCPCD_WPA *wpa)
+{
+	size_t lens[WPA_EVENT_BATCH];
+	int i, n;
+	bool scanned;
+
+	assert(wpa);
+	if (wpa->event_buf == NULL &&
+	    (wpa->event_buf = malloc(WPA_EVENT_SIZE * WPA_EVENT_BATCH)) == NULL)
+		return;
+
+	scanned = false;
+	do {
+		n = wpa_event_recv(wpa, lens);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			dhcpcd_wpa_close(wpa);
+			return;
+		}
+		wpa->ping_due = dhcpcd_now() + DHCPCD_WPA_PING;
+		for (i = 0; i < n; i++) {
+			if (dhcpcd_wpa_event(wpa,
+			    wpa->event_buf + (i * WPA_EVENT_SIZE), lens[i]))
+				scanned = true;
+			/* The event may have closed us */
+			if (wpa->listen_fd == -1)
+				return;
+		}
+	} while (n == WPA_EVENT_BATCH);
+
+	if (!scanned)
+		return;
+	/* Scan results from anyone push back our next scan */
+	dhcpcd_wpa_scan_schedule(wpa, dhcpcd_now());
+	/* They are reported once the table is refreshed */
+	if (dhcpcd_wpa_bss_refresh(wpa) == -1 && wpa->command_fd != -1) {
+		dhcpcd_wpa_bss_free(wpa);
+		dhcpcd_wpa_scan_results(wpa);
+	}
 }
 
 void
@@ -1156,6 +2977,87 @@ dhcpcd_wpa_if_event(DHCPCD_IF *i)
 	}
 }
 
+#ifdef __linux__
+#define	WPA_DIR_MASK	(IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+#endif
+
+/* Watch WPA_CTRL_DIR so we know when wpa_supplicant removes
+ * its socket, in case we missed CTRL-EVENT-TERMINATING. */
+static void
+dhcpcd_wpa_dir_watch(DHCPCD_CONNECTION *con)
+{
+
+#ifdef __linux__
+	if (con->wpa_dir_fd == -1) {
+		con->wpa_dir_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (con->wpa_dir_fd == -1)
+			return;
+	}
+	if (con->wpa_dir_wd == -1)
+		con->wpa_dir_wd = inotify_add_watch(con->wpa_dir_fd,
+		    WPA_CTRL_DIR, WPA_DIR_MASK);
+#else
+	UNUSED(con);
+#endif
+}
+
+int
+dhcpcd_wpa_get_dir_fd(DHCPCD_CONNECTION *con)
+{
+
+	assert(con);
+	return con->wpa_dir_fd;
+}
+
+void
+dhcpcd_wpa_dir_dispatch(DHCPCD_CONNECTION *con)
+{
+#ifdef __linux__
+	union {
+		struct inotify_event ev;
+		char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	} u[4];
+	const struct inotify_event *ev;
+	DHCPCD_WPA *wpa;
+	char *p, *end;
+	ssize_t bytes;
+	bool all;
+
+	assert(con);
+	all = false;
+	while ((bytes = read(con->wpa_dir_fd, u, sizeof(u))) > 0) {
+		end = (char *)u + bytes;
+		for (p = (char *)u; p < end;
+		    p += sizeof(*ev) + ev->len)
+		{
+			ev = (const struct inotify_event *)(void *)p;
+			if (ev->mask & IN_IGNORED)
+				con->wpa_dir_wd = -1;
+			if (ev->mask & (IN_IGNORED | IN_Q_OVERFLOW)) {
+				all = true;
+				continue;
+			}
+			if (ev->len != 0 &&
+			    (wpa = dhcpcd_wpa_find(con, ev->name)) != NULL)
+				dhcpcd_wpa_close(wpa);
+		}
+	}
+
+	/* The directory has gone or we lost events,
+	 * so check each socket is still there. */
+	if (all) {
+		dhcpcd_wpa_dir_watch(con);
+		for (wpa = con->wpa; wpa; wpa = wpa->next) {
+			if (wpa->command_fd != -1 &&
+			    dhcpcd_wpa_ping_async(wpa) == -1)
+				dhcpcd_wpa_close(wpa);
+		}
+	}
+#else
+	assert(con);
+#endif
+}
+
 void
 dhcpcd_wpa_start(DHCPCD_CONNECTION *con)
 {
@@ -1163,6 +3065,7 @@ dhcpcd_wpa_start(DHCPCD_CONNECTION *con)
 
 	assert(con);
 	con->wpa_started = true;
+	dhcpcd_wpa_dir_watch(con);
 
 	for (i = con->interfaces; i; i = i->next)
 		dhcpcd_wpa_if_event(i);
@@ -1190,104 +3093,219 @@ dhcpcd_wpa_var_mgmt(DHCPCD_WI_SCAN *s)
 	return "NONE";
 }
 
-static int
-dhcpcd_wpa_configure1(DHCPCD_WPA *wpa, DHCPCD_WI_SCAN *s, const char *psk)
+/* Work out the commands needed from the network table and
+ * pipeline them, so joining a known network doesn't cost a
+ * disconnect and a reload of the whole configuration.
+ * Selecting a network disables the others, which should not be saved,
+ * so we only need to RECONFIGURE when saving with networks disabled. */
+int
+dhcpcd_wpa_configure(DHCPCD_WPA *wpa, DHCPCD_WI_SCAN *s, const char *psk)
 {
+	struct wpa_txn txn = { 0, DHCPCD_WPA_SUCCESS };
+	DHCPCD_WPA_NET *n;
 	const char *mgmt, *var;
-	int id, retval;
-	char *npsk;
-	size_t psk_len;
-	bool r;
-
-	if (!dhcpcd_wpa_disconnect(wpa))
-		return DHCPCD_WPA_ERR_DISCONN;
+	char essid[IF_SSIDSIZE], cmd[IF_SSIDSIZE + 32], buf[32], *npsk;
+	int id;
+	size_t i, psk_len;
+	bool add, set_mgmt, set_psk, enable, write, reconf, current;
 
-	/* reload the configuration so that when we don't save
-	 * the disabled networks to the config file. */
-	if (!dhcpcd_wpa_reconfigure(wpa))
-		return DHCPCD_WPA_ERR_RECONF;
+	assert(wpa);
+	assert(s);
 
-	id = dhcpcd_wpa_network_find_new(wpa, s->ssid);
-	if (id == -1)
+	if (dhcpcd_wpa_net_load(wpa) == -1)
 		return DHCPCD_WPA_ERR;
 
 	mgmt = dhcpcd_wpa_var_mgmt(s);
-	if (mgmt && !dhcpcd_wpa_network_set(wpa, id, "key_mgmt", mgmt))
-		return DHCPCD_WPA_ERR_SET;
-
 	var = dhcpcd_wpa_var_psk(s);
-	if (var) {
+	n = dhcpcd_wpa_net_find(wpa, s->ssid);
+	add = n == NULL;
+	id = add ? -1 : n->id;
+	current = !add && n->flags & WNF_CURRENT;
+	set_mgmt = add || strcmp(n->key_mgmt, mgmt) != 0;
+	/* We can't read the psk back, so set it if given. */
+	set_psk = var && (add || psk != NULL);
+	enable = add || n->flags & WNF_DISABLED;
+	write = set_mgmt || set_psk || enable;
+	reconf = false;
+	if (write) {
+		for (i = 0; i < wpa->net_len; i++) {
+			if (wpa->net[i].id != id &&
+			    wpa->net[i].flags & WNF_DISABLED)
+			{
+				reconf = true;
+				break;
+			}
+		}
+	}
+	if (add && dhcpcd_wpa_network_ssid(essid, s->ssid) == -1)
+		return DHCPCD_WPA_ERR;
+
+	if (!current)
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_DISCONN,
+		    "DISCONNECT", NULL, 0);
+	if (reconf)
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_RECONF,
+		    "RECONFIGURE", NULL, 0);
+	if (add)
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR,
+		    "ADD_NETWORK", buf, sizeof(buf));
+	if (reconf || add) {
+		wpa->net_loaded = false;
+		if (wpa_txn_wait(wpa, &txn) != DHCPCD_WPA_SUCCESS)
+			goto out;
+		if (add) {
+			if (dhcpcd_strtoi(&id, buf) == -1 || id < 0) {
+				txn.retval = DHCPCD_WPA_ERR;
+				goto out;
+			}
+		} else {
+			/* The ids may change when the config is reloaded */
+			if ((id = dhcpcd_wpa_network_find(wpa, s->ssid)) == -1)
+			{
+				txn.retval = DHCPCD_WPA_ERR;
+				goto out;
+			}
+		}
+	}
 
+	if (add) {
+		snprintf(cmd, sizeof(cmd), "SET_NETWORK %d ssid %s",
+		    id, essid);
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_SET, cmd, NULL, 0);
+	}
+	if (set_mgmt) {
+		snprintf(cmd, sizeof(cmd), "SET_NETWORK %d key_mgmt %s",
+		    id, mgmt);
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_SET, cmd, NULL, 0);
+	}
+	if (set_psk) {
 		if (psk)
 			psk_len = strlen(psk);
 		else
 			psk_len = 0;
-		npsk = malloc(psk_len + 3);
-		if (npsk == NULL)
-			return DHCPCD_WPA_ERR;
-		npsk[0] = '"';
-		if (psk_len)
-			memcpy(npsk + 1, psk, psk_len);
-		npsk[psk_len + 1] = '"';
-		npsk[psk_len + 2] = '\0';
-		r = dhcpcd_wpa_network_set(wpa, id, var, npsk);
+		npsk = malloc(psk_len + 64);
+		if (npsk == NULL) {
+			if (txn.retval == DHCPCD_WPA_SUCCESS)
+				txn.retval = DHCPCD_WPA_ERR;
+			goto out;
+		}
+		snprintf(npsk, psk_len + 64, "SET_NETWORK %d %s \"%s\"",
+		    id, var, psk ? psk : "");
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_SET_PSK, npsk, NULL, 0);
 		free(npsk);
-		if (!r)
-			return DHCPCD_WPA_ERR_SET_PSK;
+	}
+	/* Don't enable, save or select a network whose settings failed,
+	 * such as a passphrase that is too short. */
+	if ((add || set_mgmt || set_psk) &&
+	    wpa_txn_wait(wpa, &txn) != DHCPCD_WPA_SUCCESS)
+		goto out;
+	if (enable) {
+		snprintf(cmd, sizeof(cmd), "ENABLE_NETWORK %d", id);
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_ENABLE, cmd, NULL, 0);
+	}
+	if (write)
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_WRITE,
+		    "SAVE_CONFIG", NULL, 0);
+	if (!current) {
+		snprintf(cmd, sizeof(cmd), "SELECT_NETWORK %d", id);
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_SELECT, cmd, NULL, 0);
 	}
 
-	if (!dhcpcd_wpa_network_enable(wpa, id))
-		return DHCPCD_WPA_ERR_ENABLE;
-	if (dhcpcd_wpa_config_write(wpa))
-		retval = DHCPCD_WPA_SUCCESS;
-	else
-		retval = DHCPCD_WPA_ERR_WRITE;
-	/* Selecting a network disables the others.
-	 * This should not be saved. */
-	if (!dhcpcd_wpa_network_select(wpa, id) && retval == DHCPCD_WPA_SUCCESS)
-		return DHCPCD_WPA_ERR_SELECT;
-	return retval;
+out:
+	/* Always reassociate if we disconnected or changed the keys */
+	if (!current || set_mgmt || set_psk)
+		wpa_txn_add(wpa, &txn, DHCPCD_WPA_ERR_ASSOC,
+		    "REASSOCIATE", NULL, 0);
+	if (write || !current)
+		wpa->net_loaded = false;
+	return wpa_txn_wait(wpa, &txn);
 }
 
-int
-dhcpcd_wpa_configure(DHCPCD_WPA *wpa, DHCPCD_WI_SCAN *s, const char *psk)
+/* Switch network with a single SELECT_NETWORK, which disconnects from
+ * the current one itself. If we are already on the SSID then ROAM to
+ * the BSS if one is given, otherwise there is nothing to do. */
+static int
+dhcpcd_wpa_select_bssid(DHCPCD_WPA *wpa, DHCPCD_WI_SCAN *s,
+    const char *bssid)
 {
-	int retval;
+	DHCPCD_WPA_NET *n;
+	char cmd[IF_BSSIDSIZE + 32];
+	int id, retval;
+
+	if (dhcpcd_wpa_net_load(wpa) == -1)
+		return DHCPCD_WPA_ERR;
+	if ((n = dhcpcd_wpa_net_find(wpa, s->ssid)) == NULL) {
+		errno = ENOENT;
+		return DHCPCD_WPA_ERR;
+	}
+
+	if (n->flags & WNF_CURRENT) {
+		if (bssid[0] == '\0')
+			return DHCPCD_WPA_SUCCESS;
+		snprintf(cmd, sizeof(cmd), "ROAM %s", bssid);
+		retval = DHCPCD_WPA_ERR_ASSOC;
+	} else {
+		snprintf(cmd, sizeof(cmd), "SELECT_NETWORK %d", n->id);
+		retval = DHCPCD_WPA_ERR_SELECT;
+	}
+
+	wpa->select_started = dhcpcd_now();
+	wpa->select_time = 0;
+	if (!dhcpcd_wpa_command(wpa, cmd)) {
+		wpa->select_started = 0;
+		return retval;
+	}
 
-	retval = dhcpcd_wpa_configure1(wpa, s, psk);
-	/* Always reassociate */
-	if (!dhcpcd_wpa_reassociate(wpa)) {
-		if (retval == DHCPCD_WPA_SUCCESS)
-			retval = DHCPCD_WPA_ERR_ASSOC;
+	/* Selecting a network disables the others. */
+	if (retval == DHCPCD_WPA_ERR_SELECT) {
+		id = n->id;
+		for (n = wpa->net; n < wpa->net + wpa->net_len; n++) {
+			if (n->id == id)
+				n->flags &= ~WNF_DISABLED;
+			else
+				n->flags |= WNF_DISABLED;
+		}
 	}
-	return retval;
+	return DHCPCD_WPA_SUCCESS;
 }
 
 int
 dhcpcd_wpa_select(DHCPCD_WPA *wpa, DHCPCD_WI_SCAN *s)
 {
-	int id, retval;
 
 	assert(wpa);
 	assert(s);
+	/* Choosing the SSID we are on should not move us off our BSS */
+	return dhcpcd_wpa_select_bssid(wpa, s, "");
+}
+
+/* As dhcpcd_wpa_select, but ROAM to a given member of the scan,
+ * which must be from dhcpcd_wi_scans.
+ * If the SSID is not the current network it is just selected and
+ * wpa_supplicant picks the BSS. */
+int
+dhcpcd_wpa_roam(DHCPCD_WPA *wpa, DHCPCD_WI_SCAN *s, const DHCPCD_WI_BSS *b)
+{
+	const DHCPCD_WI_BSS *bss;
+	size_t len;
 
-	id = dhcpcd_wpa_network_find(wpa, s->ssid);
-	if (id == -1)
+	assert(wpa);
+	assert(s);
+	assert(b);
+	bss = dhcpcd_wi_scan_bss(s, &len);
+	if (b < bss || b >= bss + len) {
+		errno = EINVAL;
 		return DHCPCD_WPA_ERR;
+	}
+	return dhcpcd_wpa_select_bssid(wpa, s, b->bssid);
+}
 
-	if (!dhcpcd_wpa_disconnect(wpa))
-		retval = DHCPCD_WPA_ERR_DISCONN;
-	else if (!dhcpcd_wpa_network_select(wpa, id))
-		retval = DHCPCD_WPA_ERR_SELECT;
-	else
-		retval = DHCPCD_WPA_SUCCESS;
+unsigned int
+dhcpcd_wpa_select_time(const DHCPCD_WPA *wpa)
+{
 
-	/* Always reassociate */
-	if (!dhcpcd_wpa_reassociate(wpa)) {
-		if (retval == DHCPCD_WPA_SUCCESS)
-			retval = DHCPCD_WPA_ERR_ASSOC;
-	}
-	return retval;
+	assert(wpa);
+	return wpa->select_time;
 }
 
 int
@@ -1297,15 +3315,19 @@ dhcpcd_wpa_freq(DHCPCD_WPA *wpa)
 	ssize_t bytes;
 	int freq;
 
-	bytes = wpa_cmd(wpa->command_fd, "STATUS", buf, sizeof(buf));
+	bytes = wpa_cmd_wait(wpa, "STATUS", buf, sizeof(buf));
 	if (bytes == 0 || bytes == -1)
 		return false;
 
+	/* STATUS lists the bssid we are associated with before freq */
+	wpa->bssid[0] = '\0';
 	p = buf;
 	while ((s = strsep(&p, "\n"))) {
 		if (*s == '\0')
 			continue;
-		if (strncmp(s, "freq=", 5) == 0) {
+		if (strncmp(s, "bssid=", 6) == 0)
+			strlcpy(wpa->bssid, s + 6, sizeof(wpa->bssid));
+		else if (strncmp(s, "freq=", 5) == 0) {
 			if (dhcpcd_strtoi(&freq, s + 5) == -1)
 				return 0;
 			return freq;